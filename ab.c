@@ -0,0 +1,426 @@
+/*
+  File: ab.c
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ab.h"
+#include "statistics.h"
+
+struct result {
+	unsigned int lineno;
+	enum shrun_status status;
+	char *output;
+	size_t output_len;
+	double *times;			/* one per run, in the order run */
+	unsigned int runs;
+};
+
+struct side {
+	struct ab *ab;
+	char *config;			/* as given */
+	char **env;
+	const char *shell;		/* NULL for the default shell */
+	struct shrun_session *session;
+	double *times;			/* runs of the current command */
+	unsigned int runs, size;
+	struct result *results;
+	size_t nresults, results_size;
+	int done;
+	struct shrun_summary summary;
+};
+
+struct ab {
+	struct shrun_text_report text;
+	struct side side[2];
+	char *words;			/* side[].env and side[].shell */
+	unsigned int rounds;
+	double threshold;
+	struct shrun_rows rows;
+	size_t reported;
+	unsigned int compared, regressions;
+	int error;
+};
+
+/*
+  Split a configuration, "[NAME=value ...] [shell]", into words. The words
+  point into config, which is modified.
+*/
+static int parse_config(struct side *side, char *config)
+{
+	char *word;
+	int n = 0;
+
+	side->env = calloc(strlen(config) / 2 + 2, sizeof(*side->env));
+	if (!side->env)
+		return -1;
+	for (word = strtok(config, " \t"); word;
+	     word = strtok(NULL, " \t")) {
+		if (side->shell) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (strchr(word, '=') && word[0] != '=' && word[0] != '/' &&
+		    word[0] != '.')
+			side->env[n++] = word;
+		else
+			side->shell = word;
+	}
+	return 0;
+}
+
+struct ab *ab_new(const char *configs, unsigned int rounds,
+		  double threshold, FILE *fp, int color)
+{
+	const char *comma = strchr(configs, ',');
+	struct ab *ab;
+	int n;
+
+	if (!comma || strchr(comma + 1, ',')) {
+		errno = EINVAL;
+		return NULL;
+	}
+	ab = calloc(1, sizeof(*ab));
+	if (!ab)
+		return NULL;
+	ab->rounds = rounds;
+	ab->threshold = threshold;
+	shrun_text_report_init(&ab->text, fp, color);
+	ab->side[0].config = shrun_copy(configs, comma - configs);
+	ab->side[1].config = strdup(comma + 1);
+	ab->words = strdup(configs);
+	if (!ab->side[0].config || !ab->side[1].config || !ab->words)
+		goto fail;
+	ab->words[comma - configs] = '\0';
+	for (n = 0; n < 2; n++) {
+		ab->side[n].ab = ab;
+		if (parse_config(&ab->side[n],
+				 n ? ab->words + (comma - configs) + 1 :
+				     ab->words) != 0)
+			goto fail;
+	}
+	return ab;
+
+fail:
+	ab_free(ab);
+	return NULL;
+}
+
+/*
+  Both sides pause after each run; the driver starts side A, and from
+  then on, each run hands over to the other side.
+*/
+void ab_options(struct ab *ab, int n, struct shrun_options *options)
+{
+	if (ab->side[n].shell)
+		options->shell = ab->side[n].shell;
+	options->env = (const char *const *)ab->side[n].env;
+	options->bench = ab->rounds;
+	options->pace = 1;
+}
+
+void *ab_priv(struct ab *ab, int n)
+{
+	return &ab->side[n];
+}
+
+void ab_start(struct ab *ab, struct shrun_session *a, struct shrun_session *b)
+{
+	ab->side[0].session = a;
+	ab->side[1].session = b;
+	shrun_session_resume(a);
+}
+
+static void hand_over(struct side *side)
+{
+	struct side *other = &side->ab->side[side == side->ab->side];
+
+	if (!other->done && other->session)
+		shrun_session_resume(other->session);
+	else if (!side->done)
+		shrun_session_resume(side->session);
+}
+
+/*
+  Compare the run times of A and B. The runs are paired by round, so the
+  ratio B/A is the geometric mean of the ratios of the pairs, with a
+  confidence interval from the t distribution of their logarithms.
+*/
+static void compare_times(struct ab *ab, struct result *a, struct result *b)
+{
+	struct shrun_text_report *text = &ab->text;
+	double sum = 0, sq = 0, mean, ratio, low = 0, high = 0;
+	unsigned int n, k = 0;
+	int regression = 0;
+
+	for (n = 0; n < a->runs && n < b->runs; n++) {
+		if (a->times[n] > 0 && b->times[n] > 0) {
+			sum += log(b->times[n] / a->times[n]);
+			k++;
+		}
+	}
+	fprintf(text->fp, ", A %.3fms, B %.3fms",
+		median(a->times, a->runs) * 1e3,
+		median(b->times, b->runs) * 1e3);
+	if (!k) {
+		fprintf(text->fp, "\n");
+		return;
+	}
+	mean = sum / k;
+	for (n = 0; n < a->runs && n < b->runs; n++) {
+		if (a->times[n] > 0 && b->times[n] > 0) {
+			double d = log(b->times[n] / a->times[n]) - mean;
+
+			sq += d * d;
+		}
+	}
+	ratio = exp(mean);
+	if (k > 1) {
+		double half = t95(k - 1) * sqrt(sq / (k - 1) / k);
+
+		low = exp(mean - half);
+		high = exp(mean + half);
+		regression = low > 1 && ratio > 1 + ab->threshold / 100;
+	}
+	ab->compared++;
+	fprintf(text->fp, ", %sB/A %.2f", regression ? text->red : "", ratio);
+	if (k > 1)
+		fprintf(text->fp, " (%.2f-%.2f)", low, high);
+	if (regression) {
+		fprintf(text->fp, ", regression");
+		ab->regressions++;
+	}
+	fprintf(text->fp, "%s\n", regression ? text->clear : "");
+}
+
+static void report_row(struct ab *ab, size_t n)
+{
+	struct shrun_text_report *text = &ab->text;
+	struct shrun_row *row = &ab->rows.row[n];
+	struct result *result[2] = { };
+	int s, all_ok = 1;
+
+	for (s = 0; s < 2; s++) {
+		if (n < ab->side[s].nresults)
+			result[s] = &ab->side[s].results[n];
+		if (!result[s] || result[s]->status != SHRUN_OK)
+			all_ok = 0;
+	}
+
+	shrun_text_report_command(text,
+				  (result[0] ? result[0] : result[1])->lineno,
+				  row->command, row->command_len);
+	if (all_ok)
+		fprintf(text->fp, "%sok%s", text->green, text->clear);
+	else {
+		for (s = 0; s < 2; s++) {
+			int ok = result[s] && result[s]->status == SHRUN_OK;
+			const char *status = result[s] ?
+				shrun_status_name(result[s]->status) :
+				"not run";
+
+			fprintf(text->fp, "%s%c: %s%s%s", s ? ", " : "",
+				'A' + s, ok ? text->green : text->red,
+				status, text->clear);
+		}
+	}
+	if (result[0] && result[1])
+		compare_times(ab, result[0], result[1]);
+	else
+		fprintf(text->fp, "\n");
+
+	for (s = 0; s < 2; s++) {
+		if (!result[s] || result[s]->status != SHRUN_FAILED)
+			continue;
+		fprintf(text->fp, "%c:\n", 'A' + s);
+		if (shrun_text_report_diff_buffers(text, result[s]->output,
+						   result[s]->output_len,
+						   row->expected,
+						   row->expected_len) != 0)
+			ab->error = 1;
+	}
+}
+
+/* Report all commands which both sides are done with. */
+static void report_rows(struct ab *ab)
+{
+	for (; ab->reported < ab->rows.n; ab->reported++) {
+		size_t n = ab->reported;
+		int s;
+
+		for (s = 0; s < 2; s++) {
+			if (n >= ab->side[s].nresults && !ab->side[s].done)
+				return;
+		}
+		report_row(ab, n);
+		for (s = 0; s < 2; s++) {
+			struct side *side = &ab->side[s];
+
+			if (n < side->nresults) {
+				free(side->results[n].output);
+				free(side->results[n].times);
+				side->results[n].output = NULL;
+				side->results[n].times = NULL;
+			}
+		}
+		shrun_rows_clear(&ab->rows, n);
+	}
+	fflush(ab->text.fp);
+}
+
+static void ab_cb_run(void *priv, double duration)
+{
+	struct side *side = priv;
+
+	if (side->runs == side->size) {
+		unsigned int size = side->size ? side->size * 2 : 16;
+		double *times = realloc(side->times, size * sizeof(*times));
+
+		if (!times)
+			side->ab->error = 1;
+		else {
+			side->times = times;
+			side->size = size;
+		}
+	}
+	if (side->runs < side->size)
+		side->times[side->runs++] = duration;
+	hand_over(side);
+}
+
+static void ab_cb_result(void *priv, const struct shrun_command *command)
+{
+	struct side *side = priv;
+	struct ab *ab = side->ab;
+	struct result *result;
+
+	if (side->nresults == side->results_size) {
+		size_t size = side->results_size ? side->results_size * 2 : 16;
+
+		result = realloc(side->results, size * sizeof(*result));
+		if (!result)
+			goto fail;
+		side->results = result;
+		side->results_size = size;
+	}
+	if (side->nresults == ab->rows.n &&
+	    shrun_rows_add(&ab->rows, command) != 0)
+		goto fail;
+	result = &side->results[side->nresults];
+	result->lineno = command->lineno;
+	result->status = command->status;
+	result->output = shrun_copy(command->output, command->output_len);
+	result->output_len = command->output_len;
+	if (!result->output)
+		goto fail;
+	result->times = side->times;
+	result->runs = side->runs;
+	side->times = NULL;
+	side->runs = side->size = 0;
+	side->nresults++;
+	report_rows(ab);
+	return;
+
+fail:
+	side->runs = 0;
+	ab->error = 1;
+}
+
+static void ab_cb_end(void *priv, const struct shrun_summary *summary)
+{
+	struct side *side = priv;
+
+	side->done = 1;
+	side->summary = *summary;
+	hand_over(side);
+	report_rows(side->ab);
+}
+
+const struct shrun_callbacks ab_callbacks = {
+	.result = ab_cb_result,
+	.run = ab_cb_run,
+	.end = ab_cb_end,
+};
+
+/*
+  Report how each side did. Returns 0 if all commands passed on both
+  sides without regressions, 1 if some failed or got slower, and 2 if a
+  side did not run to the end.
+*/
+int ab_result(struct ab *ab)
+{
+	int s, retval = 0;
+
+	for (s = 0; s < 2; s++) {
+		struct side *side = &ab->side[s];
+
+		fprintf(ab->text.fp, "%c (%s): ", 'A' + s,
+			*side->config ? side->config : "default");
+		if (side->summary.end == SHRUN_DONE &&
+		    side->summary.passed + side->summary.failed == 0)
+			fprintf(ab->text.fp, "no commands\n");
+		else
+			shrun_text_callbacks.end(&ab->text, &side->summary);
+		if (!side->done || side->summary.end != SHRUN_DONE)
+			retval = 2;
+		else if (side->summary.failed && retval < 1)
+			retval = 1;
+	}
+	fprintf(ab->text.fp, "%s%u command%s compared, %u regression%s%s\n",
+		ab->regressions ? ab->text.red : ab->text.green,
+		ab->compared, ab->compared == 1 ? "" : "s",
+		ab->regressions, ab->regressions == 1 ? "" : "s",
+		ab->text.clear);
+	fflush(ab->text.fp);
+	if (ab->regressions && retval < 1)
+		retval = 1;
+	if (ab->error)
+		retval = 2;
+	return retval;
+}
+
+void ab_free(struct ab *ab)
+{
+	size_t n;
+	int s;
+
+	if (!ab)
+		return;
+	for (s = 0; s < 2; s++) {
+		struct side *side = &ab->side[s];
+
+		for (n = 0; n < side->nresults; n++) {
+			free(side->results[n].output);
+			free(side->results[n].times);
+		}
+		free(side->results);
+		free(side->times);
+		free(side->env);
+		free(side->config);
+	}
+	shrun_rows_free(&ab->rows);
+	free(ab->words);
+	free(ab);
+}
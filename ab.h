@@ -0,0 +1,46 @@
+/*
+  File: ab.h
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#ifndef __AB_H
+#define __AB_H
+
+#include "shrun.h"
+
+/*
+  Compare how long the commands of a script take in two configurations,
+  A and B. Each configuration is a list of NAME=value environment
+  settings, optionally followed by a shell. The two sessions take turns
+  for every single run of every command, so that changes in the load of
+  the machine affect both the same way.
+*/
+
+struct ab;
+
+extern struct ab *ab_new(const char *configs, unsigned int rounds,
+			 double threshold, FILE *fp, int color);
+extern void ab_options(struct ab *ab, int n, struct shrun_options *options);
+extern const struct shrun_callbacks ab_callbacks;
+extern void *ab_priv(struct ab *ab, int n);
+extern void ab_start(struct ab *ab, struct shrun_session *a,
+		     struct shrun_session *b);
+extern int ab_result(struct ab *ab);
+extern void ab_free(struct ab *ab);
+
+#endif  /* __AB_H */
@@ -0,0 +1,102 @@
+/*
+  File: compress.c
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compress.h"
+
+static const struct {
+	const char *suffix, *compressor;
+} compressors[] = {
+	{ ".gz", "gzip" },
+	{ ".zst", "zstd" },
+};
+
+const char *compressor(const char *name)
+{
+	size_t len = strlen(name), n;
+
+	for (n = 0; n < sizeof(compressors) / sizeof(*compressors); n++) {
+		size_t slen = strlen(compressors[n].suffix);
+
+		if (len > slen &&
+		    strcmp(name + len - slen, compressors[n].suffix) == 0)
+			return compressors[n].compressor;
+	}
+	return NULL;
+}
+
+pid_t compress_start(const char *compressor, int decompress, int fd,
+		     int *pipe_fd)
+{
+	pid_t pid;
+	int p[2];
+
+	/* The shells must not keep the pipe open. */
+	if (pipe2(p, O_CLOEXEC) != 0)
+		return -1;
+	pid = fork();
+	if (pid < 0) {
+		close(p[0]);
+		close(p[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		if (dup2(decompress ? fd : p[0], STDIN_FILENO) < 0 ||
+		    dup2(decompress ? p[1] : fd, STDOUT_FILENO) < 0)
+			_exit(127);
+		signal(SIGPIPE, SIG_DFL);
+		if (decompress)
+			execlp(compressor, compressor, "-dc", NULL);
+		else
+			execlp(compressor, compressor, "-c", NULL);
+		fprintf(stderr, "%s: %s\n", compressor, strerror(errno));
+		_exit(127);
+	}
+	if (decompress) {
+		close(p[1]);
+		*pipe_fd = p[0];
+	} else {
+		close(p[0]);
+		*pipe_fd = p[1];
+	}
+	return pid;
+}
+
+int compress_wait(pid_t pid)
+{
+	int status;
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR)
+			return -1;
+	}
+	if (WIFSIGNALED(status) && WTERMSIG(status) == SIGPIPE)
+		return 0;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
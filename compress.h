@@ -0,0 +1,48 @@
+/*
+  File: compress.h
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#ifndef __COMPRESS_H
+#define __COMPRESS_H
+
+#include <unistd.h>
+
+/*
+  Scripts ending in .gz or .zst are compressed. They are passed through
+  gzip or zstd as a stream, so they are never in memory or on disk as a
+  whole uncompressed.
+*/
+
+/* The compressor for a script name, or NULL if it is not compressed. */
+extern const char *compressor(const char *name);
+/*
+  Start the compressor on file descriptor fd: to decompress what fd reads,
+  or to compress into what fd writes. Returns the process ID, and the
+  other end in *pipe_fd.
+*/
+extern pid_t compress_start(const char *compressor, int decompress, int fd,
+			    int *pipe_fd);
+/*
+  Wait for the compressor (after closing the pipe). Returns -1 if it
+  failed. A decompressor whose output was not read to the end does not
+  count as failed.
+*/
+extern int compress_wait(pid_t pid);
+
+#endif  /* __COMPRESS_H */
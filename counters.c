@@ -0,0 +1,206 @@
+/*
+  File: counters.c
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "counters.h"
+
+/*
+  Counters are perf events on the shell which its children inherit. The
+  counts of a child are added when it exits, so the counts of a command
+  include all its processes which have exited by the time its end marker
+  arrives. Hardware counters only count user space, so that instruction
+  counts are stable from run to run.
+
+  Where the hardware has no cycle counter (as in many virtual machines),
+  the cpu-clock software event is counted instead; perf does the same.
+*/
+
+static const struct event {
+	const char *name;
+	unsigned int type;
+	unsigned long long config;
+	const char *fallback;
+} events[] = {
+	{ "task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	{ "cpu-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK },
+	{ "context-switches", PERF_TYPE_SOFTWARE,
+	  PERF_COUNT_SW_CONTEXT_SWITCHES },
+	{ "cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+	{ "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+	{ "minor-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN },
+	{ "major-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cpu-clock" },
+	{ "branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+	{ "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	{ "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ }
+};
+
+static const struct event *find_event(const char *name, size_t len)
+{
+	const struct event *event;
+
+	for (event = events; event->name; event++) {
+		if (strlen(event->name) == len &&
+		    strncmp(event->name, name, len) == 0)
+			return event;
+	}
+	return NULL;
+}
+
+/*
+  Look up the events in a comma separated list. Returns the number of
+  events, or -1 if an event is unknown or there are too many.
+*/
+static int parse_events(const char *list, const struct event **found)
+{
+	int n = 0;
+
+	for (;;) {
+		size_t len = strcspn(list, ",");
+
+		if (n == SHRUN_COUNTERS_MAX)
+			return -1;
+		found[n] = find_event(list, len);
+		if (!found[n])
+			return -1;
+		n++;
+		if (!list[len])
+			break;
+		list += len + 1;
+	}
+	return n;
+}
+
+int shrun_counters_check(const char *list)
+{
+	const struct event *found[SHRUN_COUNTERS_MAX];
+
+	return parse_events(list, found) < 0 ? -1 : 0;
+}
+
+static int open_event(const struct event *event, pid_t pid)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = event->type;
+	attr.config = event->config;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+			   PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr.inherit = 1;
+	attr.exclude_kernel = (event->type == PERF_TYPE_HARDWARE);
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, pid, -1, -1,
+		       PERF_FLAG_FD_CLOEXEC);
+}
+
+/* Read a counter, scaled up if it only ran part of the time. */
+static unsigned long long read_counter(int fd)
+{
+	unsigned long long buf[3];
+
+	if (read(fd, buf, sizeof(buf)) != sizeof(buf) || !buf[2])
+		return 0;
+	if (buf[2] < buf[1])
+		return (long double)buf[0] * buf[1] / buf[2];
+	return buf[0];
+}
+
+void counters_init(struct counters *counters)
+{
+	counters->n = 0;
+}
+
+/*
+  Start counting the events in list for process pid and its future
+  children. Events which cannot be counted are not counted.
+*/
+int counters_open(struct counters *counters, const char *list, pid_t pid)
+{
+	const struct event *found[SHRUN_COUNTERS_MAX];
+	int n, count;
+
+	count = parse_events(list, found);
+	if (count < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (n = 0; n < count; n++) {
+		const struct event *event = found[n];
+		int fd;
+
+		fd = open_event(event, pid);
+		if (fd == -1 && event->fallback) {
+			event = find_event(event->fallback,
+					   strlen(event->fallback));
+			fd = open_event(event, pid);
+		}
+		counters->fd[n] = fd;
+		counters->name[n] = event->name;
+		counters->start[n] = 0;
+	}
+	counters->n = count;
+	return 0;
+}
+
+void counters_start(struct counters *counters)
+{
+	unsigned int n;
+
+	for (n = 0; n < counters->n; n++) {
+		if (counters->fd[n] != -1)
+			counters->start[n] = read_counter(counters->fd[n]);
+	}
+}
+
+void counters_stop(struct counters *counters, struct shrun_counters *result)
+{
+	unsigned int n;
+
+	result->n = counters->n;
+	for (n = 0; n < counters->n; n++) {
+		result->name[n] = counters->name[n];
+		if (counters->fd[n] == -1)
+			result->value[n] = SHRUN_NOT_COUNTED;
+		else
+			result->value[n] = read_counter(counters->fd[n]) -
+					   counters->start[n];
+	}
+}
+
+void counters_close(struct counters *counters)
+{
+	unsigned int n;
+
+	for (n = 0; n < counters->n; n++) {
+		if (counters->fd[n] != -1)
+			close(counters->fd[n]);
+	}
+	counters->n = 0;
+}
@@ -0,0 +1,43 @@
+/*
+  File: counters.h
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#ifndef __COUNTERS_H
+#define __COUNTERS_H
+
+#include <sys/types.h>
+
+#include "shrun.h"
+
+struct counters {
+	unsigned int n;
+	int fd[SHRUN_COUNTERS_MAX];
+	const char *name[SHRUN_COUNTERS_MAX];
+	unsigned long long start[SHRUN_COUNTERS_MAX];
+};
+
+extern void counters_init(struct counters *counters);
+extern int counters_open(struct counters *counters, const char *list,
+			 pid_t pid);
+extern void counters_start(struct counters *counters);
+extern void counters_stop(struct counters *counters,
+			  struct shrun_counters *result);
+extern void counters_close(struct counters *counters);
+
+#endif  /* __COUNTERS_H */
@@ -0,0 +1,943 @@
+/*
+  File: dist.c
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <libgen.h>
+#include <time.h>
+
+#include "queue.h"
+#include "history.h"
+#include "dist.h"
+
+/*
+  A coordinator hands out scripts to workers, which run them and send back
+  the report and, in update mode, the updated script. Workers connect to
+  the coordinator and ask for work, so that a fast worker ends up running
+  more scripts than a slow one. Scripts are handed out in the order they
+  are passed in, and their reports are shown in that order as well.
+
+  Workers must know the token in $SHRUN_TOKEN of the coordinator, which is
+  required over TCP; only the user can connect to a Unix domain socket.
+  Without a host, the coordinator only listens on the loopback interface.
+  Messages are limited in size, and the coordinator never blocks writing
+  to a worker.
+
+  Messages consist of a type byte, a four-byte payload length in network
+  byte order, and the payload:
+
+    worker to coordinator:
+      'H' hello (protocol version, a newline, and the token)
+      'R' next chunk of the report
+      'U' updated script
+      'E' end of script (exit status in decimal)
+
+    coordinator to worker:
+      'O' options (null-terminated strings)
+      'S' script (null-terminated name, followed by the contents)
+      'Q' quit
+*/
+
+#define DIST_VERSION "shrun 2"
+#define DIST_RETRIES 3
+
+/* The longest messages before and after the hello. */
+#define DIST_HELLO_MAX 4096
+#define DIST_MSG_MAX (256 << 20)
+
+struct job {
+	const char *name;
+	char *key;			/* in the history */
+	char *script;
+	size_t size;
+	struct queue report;
+	int status, tries, running, failed;
+	double start;
+};
+
+struct conn {
+	int fd, ready;
+	struct queue in, out;
+	struct job *job;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const void *buf, size_t size)
+{
+	while (size) {
+		ssize_t sz = write(fd, buf, size);
+
+		if (sz < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (const char *)buf + sz;
+		size -= sz;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t size)
+{
+	while (size) {
+		ssize_t sz = read(fd, buf, size);
+
+		if (sz <= 0) {
+			if (sz < 0 && errno == EINTR)
+				continue;
+			if (sz == 0)
+				errno = ECONNRESET;
+			return -1;
+		}
+		buf = (char *)buf + sz;
+		size -= sz;
+	}
+	return 0;
+}
+
+static int send_msg(int fd, char type, const void *buf, size_t size)
+{
+	unsigned char header[5];
+
+	header[0] = type;
+	header[1] = size >> 24;
+	header[2] = size >> 16;
+	header[3] = size >> 8;
+	header[4] = size;
+	if (write_all(fd, header, 5) != 0 || write_all(fd, buf, size) != 0)
+		return -1;
+	return 0;
+}
+
+static size_t msg_size(const unsigned char *header)
+{
+	return ((size_t)header[1] << 24) | (header[2] << 16) |
+	       (header[3] << 8) | header[4];
+}
+
+/*
+  Receive a message. The payload is null-terminated for convenience.
+  Returns the message type, 0 at end of file, or -1 on errors.
+*/
+static int recv_msg(int fd, char **pbuf, size_t *psize)
+{
+	unsigned char header[5];
+	ssize_t sz;
+	size_t size;
+	char *buf;
+
+	do
+		sz = read(fd, header, 1);
+	while (sz < 0 && errno == EINTR);
+	if (sz <= 0)
+		return sz;
+	if (read_all(fd, header + 1, 4) != 0)
+		return -1;
+	size = msg_size(header);
+	if (size > DIST_MSG_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	buf = malloc(size + 1);
+	if (!buf)
+		return -1;
+	if (read_all(fd, buf, size) != 0) {
+		free(buf);
+		return -1;
+	}
+	buf[size] = '\0';
+	*pbuf = buf;
+	*psize = size;
+	return header[0];
+}
+
+/*
+  Addresses are either "unix:path", a path containing a slash, or
+  "host:port".
+*/
+static int unix_addr(const char *addr)
+{
+	return strncmp(addr, "unix:", 5) == 0 || strchr(addr, '/');
+}
+
+/* The hello message: the protocol version and the token. */
+static char *hello(void)
+{
+	const char *token = getenv("SHRUN_TOKEN");
+	char *buf;
+
+	if (!token)
+		token = "";
+	buf = malloc(strlen(DIST_VERSION) + strlen(token) + 2);
+	if (buf)
+		sprintf(buf, "%s\n%s", DIST_VERSION, token);
+	return buf;
+}
+
+/* Compare without giving away how much of the token matched. */
+static int same_hello(const char *buf, size_t size, const char *expected)
+{
+	unsigned char diff = 0;
+	size_t n;
+
+	if (size != strlen(expected))
+		return 0;
+	for (n = 0; n < size; n++)
+		diff |= buf[n] ^ expected[n];
+	return diff == 0;
+}
+
+static int dist_socket(const char *addr, int listening)
+{
+	struct addrinfo hints, *res, *ai;
+	char *host, *port;
+	int fd = -1, err;
+
+	if (unix_addr(addr)) {
+		struct sockaddr_un sun;
+		mode_t mask;
+
+		if (strncmp(addr, "unix:", 5) == 0)
+			addr += 5;
+		if (strlen(addr) >= sizeof(sun.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, addr);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+		if (listening) {
+			unlink(addr);
+			mask = umask(077);
+			err = bind(fd, (struct sockaddr *)&sun, sizeof(sun));
+			umask(mask);
+			if (err != 0 || listen(fd, 16) != 0)
+				goto fail;
+		} else if (connect(fd, (struct sockaddr *)&sun,
+				   sizeof(sun)) != 0)
+			goto fail;
+		return fd;
+	}
+
+	host = strdup(addr);
+	if (!host)
+		return -1;
+	port = strrchr(host, ':');
+	if (!port) {
+		free(host);
+		errno = EINVAL;
+		return -1;
+	}
+	*port++ = '\0';
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	/* Without a host, listen on and connect to the loopback interface. */
+	err = getaddrinfo(*host ? host : "localhost", port, &hints, &res);
+	free(host);
+	if (err) {
+		errno = EADDRNOTAVAIL;
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		int one = 1;
+
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (listening) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+				   &one, sizeof(one));
+			if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+			    listen(fd, 16) == 0)
+				break;
+		} else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+
+fail:
+	err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+static int read_file(const char *name, char **pbuf, size_t *psize)
+{
+	struct queue queue;
+	ssize_t sz;
+	char *buf;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	queue_init(&queue);
+	for (;;) {
+		buf = queue_write_pos(&queue, 4096, &sz);
+		if (!buf)
+			goto fail;
+		sz = read(fd, buf, sz);
+		if (sz < 0)
+			goto fail;
+		if (sz == 0)
+			break;
+		queue_advance_write(&queue, sz);
+	}
+	close(fd);
+	*psize = queue_length(&queue);
+	*pbuf = queue.buffer;
+	return 0;
+
+fail:
+	close(fd);
+	queue_destroy(&queue);
+	return -1;
+}
+
+static int write_file(const char *name, const char *buf, size_t size)
+{
+	int fd;
+
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		return -1;
+	if (write_all(fd, buf, size) != 0) {
+		close(fd);
+		return -1;
+	}
+	return close(fd);
+}
+
+static int apply_update(const char *script, const char *buf, size_t size,
+			replace_script_t replace)
+{
+	char *tmpfile;
+	int fd, retval = -1;
+
+	tmpfile = malloc(strlen(script) + 8);
+	if (!tmpfile)
+		return -1;
+	sprintf(tmpfile, "%s.XXXXXX", script);
+	fd = mkstemp(tmpfile);
+	if (fd < 0)
+		goto out;
+	if (write_all(fd, buf, size) != 0 || close(fd) != 0 ||
+	    replace(script, tmpfile) != 0)
+		unlink(tmpfile);
+	else
+		retval = 0;
+out:
+	free(tmpfile);
+	return retval;
+}
+
+/* Write out as much of what is queued for a worker as it takes. */
+static int flush_conn(struct conn *conn)
+{
+	ssize_t sz;
+	char *buf;
+
+	while ((buf = queue_read_pos(&conn->out, &sz))) {
+		sz = write(conn->fd, buf, sz);
+		if (sz < 0)
+			return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+		queue_advance_read(&conn->out, sz);
+	}
+	return 0;
+}
+
+static int put_data(struct conn *conn, const void *buf, size_t size)
+{
+	if (!queue_write_pos(&conn->out, size, NULL))
+		return -1;
+	memcpy(conn->out.write, buf, size);
+	queue_advance_write(&conn->out, size);
+	return 0;
+}
+
+static int put_header(struct conn *conn, char type, size_t size)
+{
+	unsigned char header[5];
+
+	header[0] = type;
+	header[1] = size >> 24;
+	header[2] = size >> 16;
+	header[3] = size >> 8;
+	header[4] = size;
+	return put_data(conn, header, 5);
+}
+
+static struct job *next_job(struct job *jobs, int njobs)
+{
+	int n;
+
+	for (n = 0; n < njobs; n++) {
+		struct job *job = &jobs[n];
+
+		if (job->status == -1 && !job->running)
+			return job;
+	}
+	return NULL;
+}
+
+static int start_job(struct conn *conn, struct job *jobs, int njobs)
+{
+	struct job *job = next_job(jobs, njobs);
+	size_t len;
+
+	if (!job)
+		return 0;
+	len = strlen(job->name) + 1;
+	if (put_header(conn, 'S', len + job->size) != 0 ||
+	    put_data(conn, job->name, len) != 0 ||
+	    put_data(conn, job->script, job->size) != 0 ||
+	    flush_conn(conn) != 0)
+		return -1;
+	job->running = 1;
+	job->start = now();
+	conn->job = job;
+	return 0;
+}
+
+static void drop_conn(struct conn *conn)
+{
+	struct job *job = conn->job;
+
+	if (job) {
+		job->running = 0;
+		queue_reset(&job->report);
+		if (++job->tries >= DIST_RETRIES) {
+			char msg[64];
+
+			snprintf(msg, sizeof(msg), "%s: worker failed\n",
+				 progname);
+			queue_append(&job->report, msg);
+			job->status = 2;
+		}
+	}
+	close(conn->fd);
+	queue_destroy(&conn->in);
+	queue_destroy(&conn->out);
+	conn->fd = -1;
+	conn->job = NULL;
+}
+
+/*
+  Handle the messages a worker has sent. Returns -1 if the connection
+  should be dropped.
+*/
+static int process_msgs(struct conn *conn, struct job *jobs, int njobs,
+			const char *options, size_t options_size,
+			const char *expected, replace_script_t replace)
+{
+	for (;;) {
+		unsigned char *header;
+		ssize_t sz;
+		size_t size;
+		char *buf;
+		struct job *job = conn->job;
+
+		header = (unsigned char *)queue_read_pos(&conn->in, &sz);
+		if (!header || sz < 5)
+			break;
+		size = msg_size(header);
+		if (size > (conn->ready ? DIST_MSG_MAX : DIST_HELLO_MAX))
+			return -1;
+		if (sz - 5 < size)
+			break;
+		buf = (char *)header + 5;
+		switch(header[0]) {
+		case 'H':
+			if (conn->ready || !same_hello(buf, size, expected))
+				return -1;
+			if (put_header(conn, 'O', options_size) != 0 ||
+			    put_data(conn, options, options_size) != 0 ||
+			    start_job(conn, jobs, njobs) != 0)
+				return -1;
+			conn->ready = 1;
+			break;
+
+		case 'R':
+			if (!conn->ready || !job)
+				return -1;
+			if (queue_write_pos(&job->report, size, NULL) == NULL)
+				return -1;
+			memcpy(job->report.write, buf, size);
+			queue_advance_write(&job->report, size);
+			break;
+
+		case 'U':
+			if (!conn->ready || !job)
+				return -1;
+			if (apply_update(job->name, buf, size, replace) != 0) {
+				fprintf(stderr, "%s: %s: %s\n",
+					progname, job->name,
+					strerror(errno));
+				job->failed = 1;
+			}
+			break;
+
+		case 'E':
+			if (!conn->ready || !job)
+				return -1;
+			job->status = job->failed ? 2 : atoi(buf);
+			history_record(job->key, 0, now() - job->start,
+				       job->status);
+			job->running = 0;
+			conn->job = NULL;
+			queue_advance_read(&conn->in, 5 + size);
+			if (start_job(conn, jobs, njobs) != 0)
+				return -1;
+			continue;
+
+		default:
+			return -1;
+		}
+		queue_advance_read(&conn->in, 5 + size);
+	}
+	return 0;
+}
+
+int coordinator(const char *addr, char **scripts, int nscripts,
+		char **options, int noptions, int color,
+		replace_script_t replace)
+{
+	struct job *jobs;
+	struct conn *conns = NULL;
+	struct pollfd *pfds = NULL;
+	int nconns = 0, listen_fd, n, done = 0, printed = 0, retval = 0;
+	int workers = 0;
+	char *opts, *expected;
+	size_t opts_size = 0;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!unix_addr(addr) &&
+	    (!getenv("SHRUN_TOKEN") || !*getenv("SHRUN_TOKEN"))) {
+		fprintf(stderr, "%s: %s: workers connecting over TCP must "
+			"know the token in SHRUN_TOKEN\n", progname, addr);
+		return 2;
+	}
+	expected = hello();
+	if (!expected)
+		goto fail;
+
+	jobs = calloc(nscripts, sizeof(*jobs));
+	if (!jobs)
+		goto fail;
+	for (n = 0; n < nscripts; n++) {
+		jobs[n].name = scripts[n];
+		jobs[n].key = history_key(scripts[n]);
+		jobs[n].status = -1;
+		queue_init(&jobs[n].report);
+		if (read_file(scripts[n], &jobs[n].script,
+			      &jobs[n].size) != 0) {
+			fprintf(stderr, "%s: %s: %s\n",
+				progname, scripts[n], strerror(errno));
+			return 2;
+		}
+		if (strlen(scripts[n]) + 1 + jobs[n].size > DIST_MSG_MAX) {
+			fprintf(stderr, "%s: %s: %s\n",
+				progname, scripts[n], strerror(EFBIG));
+			return 2;
+		}
+	}
+
+	/* Forward our options, but with the colors resolved here. */
+	for (n = 0; n < noptions; n++)
+		opts_size += strlen(options[n]) + 1;
+	opts = malloc(opts_size + 16);
+	if (!opts)
+		goto fail;
+	opts_size = 0;
+	for (n = 0; n < noptions; n++) {
+		strcpy(opts + opts_size, options[n]);
+		opts_size += strlen(options[n]) + 1;
+	}
+	strcpy(opts + opts_size, color ? "--color=always" : "--color=never");
+	opts_size += strlen(opts + opts_size) + 1;
+
+	listen_fd = dist_socket(addr, 1);
+	if (listen_fd < 0) {
+		fprintf(stderr, "%s: %s: %s\n",
+			progname, addr, strerror(errno));
+		return 2;
+	}
+
+	while (done < nscripts) {
+		int count = 0, ready;
+
+		pfds = realloc(pfds, (nconns + 1) * sizeof(*pfds));
+		if (!pfds)
+			goto fail;
+		pfds[count].fd = listen_fd;
+		pfds[count++].events = POLLIN;
+		for (n = 0; n < nconns; n++) {
+			pfds[count].fd = conns[n].fd;
+			pfds[count++].events = POLLIN |
+				(queue_empty(&conns[n].out) ? 0 : POLLOUT);
+		}
+		if (poll(pfds, count, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			goto fail;
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			int fd = accept(listen_fd, NULL, NULL);
+
+			if (fd >= 0) {
+				conns = realloc(conns, (nconns + 1) *
+							sizeof(*conns));
+				if (!conns)
+					goto fail;
+				fcntl(fd, F_SETFL,
+				      fcntl(fd, F_GETFL) | O_NONBLOCK);
+				conns[nconns].fd = fd;
+				conns[nconns].ready = 0;
+				conns[nconns].job = NULL;
+				queue_init(&conns[nconns].in);
+				queue_init(&conns[nconns].out);
+				nconns++;
+			}
+		}
+		for (n = 1; n < count; n++) {
+			struct conn *conn = &conns[n - 1];
+			int was_ready = conn->ready;
+			ssize_t sz;
+			char *buf;
+
+			if ((pfds[n].revents & POLLOUT) &&
+			    flush_conn(conn) != 0) {
+				drop_conn(conn);
+				continue;
+			}
+			if (!(pfds[n].revents & ~POLLOUT))
+				continue;
+			buf = queue_write_pos(&conn->in, 65536, &sz);
+			if (!buf)
+				goto fail;
+			sz = read(conn->fd, buf, sz);
+			if (sz < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+			if (sz <= 0) {
+				drop_conn(conn);
+				continue;
+			}
+			queue_advance_write(&conn->in, sz);
+			if (process_msgs(conn, jobs, nscripts, opts, opts_size,
+					 expected, replace) != 0)
+				drop_conn(conn);
+			else if (!was_ready && conn->ready)
+				workers++;
+		}
+
+		/* Forget about dropped connections. */
+		for (n = 0; n < nconns; ) {
+			if (conns[n].fd == -1)
+				conns[n] = conns[--nconns];
+			else
+				n++;
+		}
+
+		/* A dropped job may now be waiting for an idle worker. */
+		for (n = 0; n < nconns; n++) {
+			if (conns[n].ready && !conns[n].job &&
+			    start_job(&conns[n], jobs, nscripts) != 0)
+				drop_conn(&conns[n]);
+		}
+
+		/*
+		  Once all workers are gone, nothing would run the rest of
+		  the scripts.
+		*/
+		for (ready = 0, n = 0; n < nconns; n++) {
+			if (conns[n].fd != -1 && conns[n].ready)
+				ready++;
+		}
+		if (workers && !ready) {
+			for (n = 0; n < nscripts; n++) {
+				char msg[64];
+
+				if (jobs[n].status != -1)
+					continue;
+				snprintf(msg, sizeof(msg),
+					 "%s: no workers left\n", progname);
+				queue_reset(&jobs[n].report);
+				queue_append(&jobs[n].report, msg);
+				jobs[n].status = 2;
+			}
+		}
+
+		/* Report in the order the scripts were given. */
+		for (done = 0, n = 0; n < nscripts; n++) {
+			if (jobs[n].status != -1)
+				done++;
+		}
+		while (printed < nscripts && jobs[printed].status != -1) {
+			struct job *job = &jobs[printed];
+			ssize_t sz;
+			char *buf;
+
+			printf("[%s]\n", job->name);
+			buf = queue_read_pos(&job->report, &sz);
+			if (buf)
+				fwrite(buf, 1, sz, stdout);
+			fflush(stdout);
+			if (job->status > retval)
+				retval = job->status;
+			printed++;
+		}
+	}
+
+	/* Tell idle workers to quit, but never wait for them. */
+	for (n = 0; n < nconns; n++) {
+		if (put_header(&conns[n], 'Q', 0) == 0)
+			flush_conn(&conns[n]);
+		close(conns[n].fd);
+		queue_destroy(&conns[n].in);
+		queue_destroy(&conns[n].out);
+	}
+	close(listen_fd);
+	if (strncmp(addr, "unix:", 5) == 0)
+		unlink(addr + 5);
+	else if (strchr(addr, '/'))
+		unlink(addr);
+	for (n = 0; n < nscripts; n++) {
+		free(jobs[n].key);
+		free(jobs[n].script);
+		queue_destroy(&jobs[n].report);
+	}
+	free(jobs);
+	free(conns);
+	free(pfds);
+	free(opts);
+	free(expected);
+	return retval;
+
+fail:
+	fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+	return 2;
+}
+
+/*
+  Run a script in a temporary directory, and send the report, the
+  updated script (if any), and the exit status back.
+*/
+static int run_job(int sock, char **options, int noptions, char *msg,
+		   size_t size, run_script_t run)
+{
+	char *name = msg, *contents, *path = NULL, *backup = NULL;
+	char dir[] = "/tmp/shrun.XXXXXX";
+	char buf[4096], status[16];
+	int p[2], retval = -1, st;
+	size_t len = strlen(name) + 1;
+	pid_t pid;
+	ssize_t sz;
+
+	if (len > size)
+		return -1;
+	contents = msg + len;
+	if (!mkdtemp(dir))
+		return -1;
+	path = malloc(strlen(dir) + strlen(name) + 3);
+	backup = malloc(strlen(dir) + strlen(name) + 4);
+	if (!path || !backup)
+		goto out;
+	sprintf(path, "%s/%s", dir, basename(name));
+	sprintf(backup, "%s~", path);
+	if (write_file(path, contents, size - len) != 0)
+		goto out;
+
+	if (pipe(p) != 0)
+		goto out;
+	pid = fork();
+	if (pid < 0) {
+		close(p[0]);
+		close(p[1]);
+		goto out;
+	}
+	if (pid == 0) {
+		close(sock);
+		close(p[0]);
+		dup2(p[1], STDOUT_FILENO);
+		dup2(p[1], STDERR_FILENO);
+		close(p[1]);
+		exit(run(options, noptions, path, name));
+	}
+	close(p[1]);
+	for (;;) {
+		sz = read(p[0], buf, sizeof(buf));
+		if (sz < 0 && errno == EINTR)
+			continue;
+		if (sz <= 0)
+			break;
+		if (send_msg(sock, 'R', buf, sz) != 0)
+			break;
+	}
+	close(p[0]);
+	while (waitpid(pid, &st, 0) < 0 && errno == EINTR)
+		;
+	if (sz != 0)
+		goto out;
+
+	if (access(backup, F_OK) == 0) {
+		char *updated;
+		size_t usize;
+
+		if (read_file(path, &updated, &usize) != 0)
+			goto out;
+		retval = send_msg(sock, 'U', updated, usize);
+		free(updated);
+		if (retval != 0)
+			goto out;
+	}
+	snprintf(status, sizeof(status), "%d",
+		 WIFEXITED(st) ? WEXITSTATUS(st) : 2);
+	retval = send_msg(sock, 'E', status, strlen(status));
+
+out:
+	if (path)
+		unlink(path);
+	if (backup)
+		unlink(backup);
+	rmdir(dir);
+	free(path);
+	free(backup);
+	return retval;
+}
+
+int worker(const char *addr, run_script_t run)
+{
+	char **options = NULL, *opts = NULL;
+	int sock, tries, noptions = 0, retval = 0;
+	char *hi;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Give the coordinator some time to start up. */
+	for (tries = 0; ; tries++) {
+		sock = dist_socket(addr, 0);
+		if (sock >= 0 || tries == 100 ||
+		    (errno != ENOENT && errno != ECONNREFUSED))
+			break;
+		usleep(100000);
+	}
+	if (sock < 0) {
+		fprintf(stderr, "%s: %s: %s\n",
+			progname, addr, strerror(errno));
+		return 2;
+	}
+	hi = hello();
+	if (!hi)
+		goto fail;
+	retval = send_msg(sock, 'H', hi, strlen(hi));
+	free(hi);
+	if (retval != 0)
+		goto fail;
+
+	for (;;) {
+		char *buf = NULL, *p;
+		size_t size = 0;
+		int type;
+
+		type = recv_msg(sock, &buf, &size);
+		if (type <= 0) {
+			if (type < 0)
+				goto fail;
+			/* The coordinator hangs up on wrong tokens. */
+			if (!opts) {
+				errno = EACCES;
+				goto fail;
+			}
+			break;
+		}
+		if (type == 'Q') {
+			free(buf);
+			break;
+		}
+		switch(type) {
+		case 'O':
+			free(options);
+			free(opts);
+			opts = buf;
+			noptions = 0;
+			for (p = opts; p < opts + size; p += strlen(p) + 1)
+				noptions++;
+			options = malloc(noptions * sizeof(*options));
+			if (!options)
+				goto fail;
+			noptions = 0;
+			for (p = opts; p < opts + size; p += strlen(p) + 1)
+				options[noptions++] = p;
+			break;
+
+		case 'S':
+			retval = run_job(sock, options, noptions, buf, size,
+					 run);
+			free(buf);
+			if (retval != 0)
+				goto fail;
+			break;
+
+		default:
+			free(buf);
+			errno = EPROTO;
+			goto fail;
+		}
+	}
+	close(sock);
+	free(options);
+	free(opts);
+	return 0;
+
+fail:
+	fprintf(stderr, "%s: %s: %s\n",
+		progname, addr, strerror(errno));
+	close(sock);
+	return 2;
+}
@@ -0,0 +1,34 @@
+/*
+  File: dist.h
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef __DIST_H
+#define __DIST_H
+
+extern const char *progname;
+
+typedef int (*run_script_t)(char **options, int noptions, const char *script,
+			    const char *name);
+typedef int (*replace_script_t)(const char *script, const char *tmpfile);
+
+extern int coordinator(const char *addr, char **scripts, int nscripts,
+		       char **options, int noptions, int color,
+		       replace_script_t replace);
+extern int worker(const char *addr, run_script_t run);
+
+#endif  /* __DIST_H */
@@ -0,0 +1,345 @@
+/*
+  File: history.c
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "history.h"
+
+/*
+  The history is a text file with one line per script and per command:
+
+    <duration> <status> <line> <script>
+
+  Durations are in seconds; for scripts, they are a moving average over
+  the past runs. Commands have their line number, and scripts line 0.
+  Scripts are identified by their absolute path.
+
+  Several shrun processes may share a history file. Changes are only
+  written out at the end: the file is locked, read in again, the entries
+  of the scripts that were run are replaced, and the result is renamed
+  into place.
+*/
+
+struct entry {
+	char *script;
+	unsigned int lineno;
+	double duration;
+	int status;
+};
+
+/*
+  The entries are hashed by script and line number: the hash table has
+  the indices of the entries plus one, and 0 for free slots.
+*/
+struct entries {
+	struct entry *entry;
+	size_t n, size;
+	size_t *hash, hash_size;
+};
+
+static char *history_file;
+
+/* The scripts in updates are also in scripts, with line 0. */
+static struct entries history, updates, scripts;
+
+static size_t hash_entry(const char *script, unsigned int lineno)
+{
+	size_t hash = 2166136261u ^ lineno;
+
+	while (*script)
+		hash = (hash ^ (unsigned char)*script++) * 16777619;
+	return hash;
+}
+
+static void hash_insert(struct entries *entries, size_t n)
+{
+	struct entry *entry = &entries->entry[n];
+	size_t mask = entries->hash_size - 1, h;
+
+	for (h = hash_entry(entry->script, entry->lineno) & mask;
+	     entries->hash[h];
+	     h = (h + 1) & mask)
+		;
+	entries->hash[h] = n + 1;
+}
+
+/* Keep the hash table at most half full. */
+static int grow_hash(struct entries *entries)
+{
+	size_t size = entries->hash_size ? entries->hash_size * 2 : 128, n;
+	size_t *hash;
+
+	if ((entries->n + 1) * 2 <= entries->hash_size)
+		return 0;
+	hash = calloc(size, sizeof(*hash));
+	if (!hash)
+		return -1;
+	free(entries->hash);
+	entries->hash = hash;
+	entries->hash_size = size;
+	for (n = 0; n < entries->n; n++)
+		hash_insert(entries, n);
+	return 0;
+}
+
+static int add_entry(struct entries *entries, const char *script,
+		     unsigned int lineno, double duration, int status)
+{
+	struct entry *entry;
+
+	if (grow_hash(entries) != 0)
+		return -1;
+	if (entries->n == entries->size) {
+		size_t size = entries->size ? entries->size * 2 : 64;
+
+		entry = realloc(entries->entry, size * sizeof(*entry));
+		if (!entry)
+			return -1;
+		entries->entry = entry;
+		entries->size = size;
+	}
+	entry = &entries->entry[entries->n];
+	entry->script = strdup(script);
+	if (!entry->script)
+		return -1;
+	entry->lineno = lineno;
+	entry->duration = duration;
+	entry->status = status;
+	hash_insert(entries, entries->n);
+	entries->n++;
+	return 0;
+}
+
+static void free_entries(struct entries *entries)
+{
+	size_t n;
+
+	for (n = 0; n < entries->n; n++)
+		free(entries->entry[n].script);
+	free(entries->entry);
+	entries->entry = NULL;
+	entries->n = entries->size = 0;
+	free(entries->hash);
+	entries->hash = NULL;
+	entries->hash_size = 0;
+}
+
+static struct entry *find_entry(struct entries *entries, const char *script,
+				unsigned int lineno)
+{
+	size_t mask = entries->hash_size - 1, h;
+
+	if (!entries->hash_size)
+		return NULL;
+	for (h = hash_entry(script, lineno) & mask;
+	     entries->hash[h];
+	     h = (h + 1) & mask) {
+		struct entry *entry = &entries->entry[entries->hash[h] - 1];
+
+		if (entry->lineno == lineno &&
+		    strcmp(entry->script, script) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+static int read_entries(const char *filename, struct entries *entries)
+{
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (!fp)
+		return errno == ENOENT ? 0 : -1;
+	while ((len = getline(&line, &size, fp)) > 0) {
+		unsigned int lineno;
+		double duration;
+		int status, pos;
+
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if (sscanf(line, "%lf %d %u %n", &duration, &status,
+			   &lineno, &pos) != 3 || !line[pos])
+			continue;
+		if (add_entry(entries, line + pos, lineno, duration,
+			      status) != 0)
+			break;
+	}
+	free(line);
+	if (ferror(fp) || !feof(fp)) {
+		fclose(fp);
+		return -1;
+	}
+	return fclose(fp);
+}
+
+/*
+  Scripts are identified by their absolute path. Returns NULL when no
+  history is kept.
+*/
+char *history_key(const char *script)
+{
+	char *key;
+
+	if (!history_file)
+		return NULL;
+	key = realpath(script, NULL);
+
+	if (!key)
+		key = strdup(script);
+	if (key && strchr(key, '\n')) {
+		free(key);
+		key = NULL;
+	}
+	return key;
+}
+
+int history_open(const char *filename)
+{
+	history_file = strdup(filename);
+	if (!history_file)
+		return -1;
+	return read_entries(history_file, &history);
+}
+
+int history_lookup(const char *key, unsigned int lineno,
+		   double *duration, int *status)
+{
+	struct entry *entry;
+
+	if (!history_file || !key)
+		return -1;
+	entry = find_entry(&history, key, lineno);
+	if (!entry)
+		return -1;
+	if (duration)
+		*duration = entry->duration;
+	if (status)
+		*status = entry->status;
+	return 0;
+}
+
+void history_record(const char *key, unsigned int lineno,
+		    double duration, int status)
+{
+	struct entry *entry;
+
+	if (!history_file || !key)
+		return;
+	if (lineno == 0) {
+		entry = find_entry(&history, key, 0);
+		if (entry)
+			duration = (entry->duration + duration) / 2;
+	}
+	entry = find_entry(&updates, key, lineno);
+	if (entry) {
+		entry->duration = duration;
+		entry->status = status;
+	} else if (add_entry(&updates, key, lineno, duration, status) == 0 &&
+		   !find_entry(&scripts, key, 0))
+		add_entry(&scripts, key, 0, 0, 0);
+}
+
+static int write_entries(FILE *fp, struct entries *entries, int skip_updated)
+{
+	size_t n;
+
+	for (n = 0; n < entries->n; n++) {
+		struct entry *entry = &entries->entry[n];
+
+		if (skip_updated && find_entry(&scripts, entry->script, 0))
+			continue;
+		fprintf(fp, "%.6f %d %u %s\n", entry->duration,
+			entry->status, entry->lineno, entry->script);
+	}
+	return ferror(fp) ? -1 : 0;
+}
+
+int history_close(void)
+{
+	struct entries current = { };
+	char *lockfile = NULL, *tmpfile = NULL;
+	int lock_fd = -1, fd, retval = -1;
+	FILE *fp;
+
+	if (!history_file)
+		return 0;
+	if (!updates.n) {
+		retval = 0;
+		goto out;
+	}
+
+	lockfile = malloc(strlen(history_file) + 6);
+	tmpfile = malloc(strlen(history_file) + 8);
+	if (!lockfile || !tmpfile)
+		goto out;
+	sprintf(lockfile, "%s.lock", history_file);
+	sprintf(tmpfile, "%s.XXXXXX", history_file);
+	lock_fd = open(lockfile, O_WRONLY | O_CREAT, 0666);
+	if (lock_fd < 0 || flock(lock_fd, LOCK_EX) != 0)
+		goto out;
+	if (read_entries(history_file, &current) != 0)
+		goto out;
+
+	fd = mkstemp(tmpfile);
+	if (fd < 0)
+		goto out;
+	fchmod(fd, 0644);
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		unlink(tmpfile);
+		goto out;
+	}
+	if (write_entries(fp, &current, 1) != 0 ||
+	    write_entries(fp, &updates, 0) != 0) {
+		fclose(fp);
+		unlink(tmpfile);
+		goto out;
+	}
+	if (fclose(fp) != 0 || rename(tmpfile, history_file) != 0) {
+		unlink(tmpfile);
+		goto out;
+	}
+	retval = 0;
+
+out:
+	if (lock_fd >= 0)
+		close(lock_fd);
+	free(lockfile);
+	free(tmpfile);
+	free_entries(&current);
+	free_entries(&history);
+	free_entries(&updates);
+	free_entries(&scripts);
+	free(history_file);
+	history_file = NULL;
+	return retval;
+}
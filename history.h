@@ -0,0 +1,37 @@
+/*
+  File: history.h
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef __HISTORY_H
+#define __HISTORY_H
+
+/*
+  Durations and results of earlier runs, by script and by command. A
+  line number of 0 stands for the whole script. Scripts are looked up by
+  the key history_key() returns for them.
+*/
+
+extern int history_open(const char *filename);
+extern char *history_key(const char *script);
+extern int history_lookup(const char *key, unsigned int lineno,
+			  double *duration, int *status);
+extern void history_record(const char *key, unsigned int lineno,
+			   double duration, int status);
+extern int history_close(void);
+
+#endif  /* __HISTORY_H */
@@ -0,0 +1,218 @@
+/*
+  File: isolate.c
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "isolate.h"
+
+/*
+  Run the shell in its own user, mount, and PID namespaces, with a private
+  tmpfs on /tmp and a private working directory in it. Everything goes
+  away when the last process in the namespaces exits. A source directory
+  below /tmp is mounted at the same place in the private tmpfs.
+
+  A new PID namespace only applies to the children of the process that
+  creates it, and the first of them becomes the init process of the
+  namespace. Signals the init process has no handler for are not delivered
+  from within the namespace, so the init process only waits for the shell,
+  and the shell runs as PID 2 where "kill -STOP $$" works as usual.
+*/
+
+#define ISOLATE_WORKDIR "/tmp/work"
+
+static const int ignored_signals[] = {
+	SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGHUP
+};
+
+static int write_string(const char *name, const char *str)
+{
+	int fd, len = strlen(str);
+
+	fd = open(name, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	if (write(fd, str, len) != len) {
+		close(fd);
+		return -1;
+	}
+	return close(fd);
+}
+
+/*
+  Map our own user and group into the new user namespace, so that the
+  files the shell creates belong to us.
+*/
+static int map_ids(uid_t uid, gid_t gid)
+{
+	char map[64];
+
+	if (write_string("/proc/self/setgroups", "deny") != 0 &&
+	    errno != ENOENT)
+		return -1;
+	snprintf(map, sizeof(map), "%u %u 1\n", uid, uid);
+	if (write_string("/proc/self/uid_map", map) != 0)
+		return -1;
+	snprintf(map, sizeof(map), "%u %u 1\n", gid, gid);
+	return write_string("/proc/self/gid_map", map);
+}
+
+/*
+  Wait for pid and exit with its status, while ignoring the signals the
+  terminal sends to the foreground process group. Other processes may be
+  reaped on the way.
+*/
+static void wait_and_exit(pid_t pid)
+{
+	int n, status;
+	pid_t p;
+
+	for (n = 0; n < sizeof(ignored_signals) / sizeof(*ignored_signals); n++)
+		signal(ignored_signals[n], SIG_IGN);
+	for (;;) {
+		p = wait(&status);
+		if (p == pid)
+			break;
+		if (p < 0 && errno != EINTR)
+			_exit(1);
+	}
+	if (WIFSIGNALED(status))
+		_exit(128 + WTERMSIG(status));
+	_exit(WEXITSTATUS(status));
+}
+
+/* Create directory path and its missing parents, like "mkdir -p". */
+static int make_dirs(char *path)
+{
+	char *slash;
+
+	for (slash = path; (slash = strchr(slash + 1, '/')); ) {
+		*slash = 0;
+		if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+			*slash = '/';
+			return -1;
+		}
+		*slash = '/';
+	}
+	if (mkdir(path, 0777) != 0 && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+/*
+  Make directory dirfd reachable as path again when the tmpfs on /tmp has
+  covered it, by mounting it there in the new tmpfs.
+*/
+static int reattach_dir(int dirfd, char *path)
+{
+	struct stat st, dir_st;
+	char name[64];
+
+	if (fstat(dirfd, &dir_st) != 0)
+		return -1;
+	if (stat(path, &st) == 0 && st.st_dev == dir_st.st_dev &&
+	    st.st_ino == dir_st.st_ino)
+		return 0;
+	if (make_dirs(path) != 0)
+		return -1;
+	snprintf(name, sizeof(name), "/proc/self/fd/%d", dirfd);
+	return mount(name, path, NULL, MS_BIND | MS_REC, NULL);
+}
+
+static int setup_mounts(void)
+{
+	char *srcdir;
+	int dirfd, retval = -1;
+
+	srcdir = get_current_dir_name();
+	if (!srcdir)
+		return -1;
+	dirfd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0)
+		goto out;
+	if (setenv("SHRUN_SRCDIR", srcdir, 1) != 0)
+		goto out;
+
+	if (mount("proc", "/proc", "proc", MS_NOSUID | MS_NODEV | MS_NOEXEC,
+		  NULL) != 0 ||
+	    mount("tmpfs", "/tmp", "tmpfs", MS_NOSUID | MS_NODEV,
+		  "mode=1777") != 0)
+		goto out;
+	if (mkdir(ISOLATE_WORKDIR, 0777) != 0 ||
+	    reattach_dir(dirfd, srcdir) != 0 || chdir(ISOLATE_WORKDIR) != 0)
+		goto out;
+	setenv("PWD", ISOLATE_WORKDIR, 1);
+	unsetenv("TMPDIR");
+	retval = 0;
+
+out:
+	if (dirfd >= 0)
+		close(dirfd);
+	free(srcdir);
+	return retval;
+}
+
+/*
+  Called in the child before executing the shell. Returns 0 in the
+  process that is to execute the shell, and -1 on errors.
+*/
+int isolate(void)
+{
+	uid_t uid = geteuid();
+	gid_t gid = getegid();
+	int flags = CLONE_NEWNS | CLONE_NEWPID;
+	pid_t pid;
+
+	/* Root can do without a user namespace, and keeps its privileges. */
+	if (uid != 0)
+		flags |= CLONE_NEWUSER;
+	if (unshare(flags) != 0)
+		return -1;
+	if ((flags & CLONE_NEWUSER) && map_ids(uid, gid) != 0)
+		return -1;
+	if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0)
+		return -1;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid != 0)
+		wait_and_exit(pid);
+
+	/* The init process of the new PID namespace. */
+	if (setup_mounts() != 0)
+		return -1;
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid != 0)
+		wait_and_exit(pid);
+	return 0;
+}
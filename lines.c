@@ -0,0 +1,159 @@
+/*
+  File: lines.c
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define HAVE_SSE2
+#endif
+
+#include "shrun.h"
+
+/*
+  Build an index of where the lines in a buffer start. Output can be
+  large, so the newlines are found sixteen or thirty-two bytes at a time
+  where the processor allows; each block without a newline costs a load
+  and a compare.
+*/
+
+static int grow(struct shrun_lines *lines, size_t n, size_t more)
+{
+	size_t size = lines->size ? lines->size : 64, *start;
+
+	if (n + more <= lines->size)
+		return 0;
+	while (size < n + more)
+		size *= 2;
+	start = realloc(lines->start, size * sizeof(*start));
+	if (!start)
+		return -1;
+	lines->start = start;
+	lines->size = size;
+	return 0;
+}
+
+/* Record the newlines in mask, relative to pos. */
+#define ADD_NEWLINES(lines, n, pos, mask) \
+	do { \
+		while (mask) { \
+			(lines)->start[(n)++] = (pos) + __builtin_ctz(mask) + 1; \
+			(mask) &= (mask) - 1; \
+		} \
+	} while (0)
+
+static ssize_t scan_scalar(struct shrun_lines *lines, size_t n,
+			   const char *buf, size_t pos, size_t sz)
+{
+	const char *newline;
+
+	while ((newline = memchr(buf + pos, '\n', sz - pos))) {
+		if (grow(lines, n, 1) != 0)
+			return -1;
+		pos = newline - buf + 1;
+		lines->start[n++] = pos;
+	}
+	return n;
+}
+
+#ifdef HAVE_SSE2
+static ssize_t scan_sse2(struct shrun_lines *lines, size_t n,
+			 const char *buf, size_t sz)
+{
+	const __m128i newline = _mm_set1_epi8('\n');
+	size_t pos;
+
+	for (pos = 0; pos + 16 <= sz; pos += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + pos));
+		unsigned int mask =
+			_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+
+		if (!mask)
+			continue;
+		if (grow(lines, n, 16) != 0)
+			return -1;
+		ADD_NEWLINES(lines, n, pos, mask);
+	}
+	return scan_scalar(lines, n, buf, pos, sz);
+}
+
+__attribute__((target("avx2")))
+static ssize_t scan_avx2(struct shrun_lines *lines, size_t n,
+			 const char *buf, size_t sz)
+{
+	const __m256i newline = _mm256_set1_epi8('\n');
+	size_t pos;
+
+	for (pos = 0; pos + 32 <= sz; pos += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + pos));
+		unsigned int mask =
+			_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline));
+
+		if (!mask)
+			continue;
+		if (grow(lines, n, 32) != 0)
+			return -1;
+		ADD_NEWLINES(lines, n, pos, mask);
+	}
+	return scan_scalar(lines, n, buf, pos, sz);
+}
+#endif
+
+static ssize_t scan(struct shrun_lines *lines, size_t n,
+		    const char *buf, size_t sz)
+{
+#ifdef HAVE_SSE2
+	static int avx2 = -1;
+
+	if (avx2 == -1) {
+		__builtin_cpu_init();
+		avx2 = __builtin_cpu_supports("avx2");
+	}
+	if (avx2)
+		return scan_avx2(lines, n, buf, sz);
+	return scan_sse2(lines, n, buf, sz);
+#else
+	return scan_scalar(lines, n, buf, 0, sz);
+#endif
+}
+
+int shrun_lines_index(struct shrun_lines *lines, const char *buf, size_t sz)
+{
+	ssize_t n;
+
+	if (grow(lines, 0, 2) != 0)
+		return -1;
+	lines->start[0] = 0;
+	n = scan(lines, 1, buf, sz);
+	if (n < 0 || grow(lines, n, 1) != 0)
+		return -1;
+	if (lines->start[n - 1] != sz)
+		lines->start[n++] = sz;
+	lines->n = n - 1;
+	return 0;
+}
+
+void shrun_lines_free(struct shrun_lines *lines)
+{
+	free(lines->start);
+	lines->start = NULL;
+	lines->n = lines->size = 0;
+}
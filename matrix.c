@@ -0,0 +1,347 @@
+/*
+  File: matrix.c
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "matrix.h"
+
+struct result {
+	unsigned int lineno;
+	enum shrun_status status;
+	int passed;			/* output and budget ok */
+	char *output;
+	size_t output_len;
+};
+
+struct shell {
+	struct matrix *matrix;
+	const char *name;
+	struct result *results;
+	size_t nresults, size;
+	int done;
+	struct shrun_summary summary;
+};
+
+struct matrix {
+	struct shrun_text_report text;
+	struct shell *shells;
+	int nshells;
+	/*
+	  The commands and expected outputs are the same for all shells, and
+	  are only kept once.
+	*/
+	struct shrun_rows rows;
+	size_t reported;
+	int error;
+};
+
+struct matrix *matrix_new(const char **shells, int nshells, FILE *fp,
+			  int color)
+{
+	struct matrix *matrix;
+	int n;
+
+	matrix = calloc(1, sizeof(*matrix));
+	if (!matrix)
+		return NULL;
+	matrix->shells = calloc(nshells, sizeof(*matrix->shells));
+	if (!matrix->shells) {
+		free(matrix);
+		return NULL;
+	}
+	matrix->nshells = nshells;
+	for (n = 0; n < nshells; n++) {
+		matrix->shells[n].matrix = matrix;
+		matrix->shells[n].name = shells[n];
+	}
+	shrun_text_report_init(&matrix->text, fp, color);
+	return matrix;
+}
+
+void *matrix_priv(struct matrix *matrix, int n)
+{
+	return &matrix->shells[n];
+}
+
+static const char *status_name(struct shell *shell, size_t n)
+{
+	if (n >= shell->nresults)
+		return "not run";
+	if (shell->results[n].status == SHRUN_OK && !shell->results[n].passed)
+		return "budget exceeded";
+	return shrun_status_name(shell->results[n].status);
+}
+
+/* Do shells a and b have the same output for command n? */
+static int same_output(struct shell *a, struct shell *b, size_t n)
+{
+	struct result *ra = &a->results[n], *rb = &b->results[n];
+
+	return ra->output_len == rb->output_len &&
+	       memcmp(ra->output, rb->output, ra->output_len) == 0;
+}
+
+static void print_diff(struct matrix *matrix, const char *buf1, size_t sz1,
+		       const char *buf2, size_t sz2)
+{
+	if (shrun_text_report_diff_buffers(&matrix->text, buf1, sz1,
+					   buf2, sz2) != 0)
+		matrix->error = 1;
+}
+
+/*
+  Print the names of the shells in the same group as shell first (with
+  the same status, or the same output).
+*/
+static void print_group(struct matrix *matrix, int first, size_t n,
+			int by_output)
+{
+	const char *status = status_name(&matrix->shells[first], n);
+	int s;
+
+	for (s = first; s < matrix->nshells; s++) {
+		struct shell *shell = &matrix->shells[s];
+
+		if (by_output ? (n >= shell->nresults ||
+				 !same_output(&matrix->shells[first],
+					      shell, n)) :
+				strcmp(status_name(shell, n), status) != 0)
+			continue;
+		fprintf(matrix->text.fp, "%s%s", s == first ? "" : ", ",
+			shell->name);
+	}
+}
+
+/* Is shell s the first in its group? */
+static int first_in_group(struct matrix *matrix, int s, size_t n,
+			  int by_output)
+{
+	int t;
+
+	for (t = 0; t < s; t++) {
+		if (by_output ? (n < matrix->shells[t].nresults &&
+				 same_output(&matrix->shells[t],
+					     &matrix->shells[s], n)) :
+				strcmp(status_name(&matrix->shells[t], n),
+				       status_name(&matrix->shells[s], n)) == 0)
+			return 0;
+	}
+	return 1;
+}
+
+static void report_row(struct matrix *matrix, size_t n)
+{
+	struct shrun_text_report *text = &matrix->text;
+	struct shrun_row *row = &matrix->rows.row[n];
+	struct shell *base = NULL;
+	int s, all_ok = 1, outputs = 0;
+
+	for (s = 0; s < matrix->nshells; s++) {
+		struct shell *shell = &matrix->shells[s];
+
+		if (n >= shell->nresults || !shell->results[n].passed)
+			all_ok = 0;
+		if (n < shell->nresults) {
+			if (!base)
+				base = shell;
+			if (first_in_group(matrix, s, n, 1))
+				outputs++;
+		}
+	}
+
+	shrun_text_report_command(text, base->results[n].lineno,
+				  row->command, row->command_len);
+	if (all_ok) {
+		fprintf(text->fp, "%sok%s\n", text->green, text->clear);
+		return;
+	}
+	for (s = 0; s < matrix->nshells; s++) {
+		const char *status = status_name(&matrix->shells[s], n);
+
+		if (!first_in_group(matrix, s, n, 0))
+			continue;
+		fprintf(text->fp, "%s%s%s: ", s ? "; " : "",
+			strcmp(status, "ok") == 0 ? text->green : text->red,
+			status);
+		print_group(matrix, s, n, 0);
+		fprintf(text->fp, "%s", text->clear);
+	}
+	fprintf(text->fp, "\n");
+
+	/* Each distinct wrong output against the expected output ... */
+	for (s = 0; s < matrix->nshells; s++) {
+		struct shell *shell = &matrix->shells[s];
+
+		if (n >= shell->nresults ||
+		    shell->results[n].status != SHRUN_FAILED ||
+		    !first_in_group(matrix, s, n, 1))
+			continue;
+		print_group(matrix, s, n, 1);
+		fprintf(text->fp, ":\n");
+		print_diff(matrix, shell->results[n].output,
+			   shell->results[n].output_len,
+			   row->expected, row->expected_len);
+	}
+
+	/*
+	  ... and against each other where they disagree, unless the first
+	  output is the expected one and this has already been shown.
+	*/
+	if (outputs > 1 && base->results[n].status != SHRUN_OK) {
+		for (s = 0; s < matrix->nshells; s++) {
+			struct shell *shell = &matrix->shells[s];
+
+			if (shell == base || n >= shell->nresults ||
+			    !first_in_group(matrix, s, n, 1))
+				continue;
+			fprintf(text->fp, "%s | %s:\n", base->name,
+				shell->name);
+			print_diff(matrix, base->results[n].output,
+				   base->results[n].output_len,
+				   shell->results[n].output,
+				   shell->results[n].output_len);
+		}
+	}
+}
+
+/* Report all commands which all shells are done with. */
+static void report_rows(struct matrix *matrix)
+{
+	for (; matrix->reported < matrix->rows.n; matrix->reported++) {
+		size_t n = matrix->reported;
+		int s;
+
+		for (s = 0; s < matrix->nshells; s++) {
+			struct shell *shell = &matrix->shells[s];
+
+			if (n >= shell->nresults && !shell->done)
+				return;
+		}
+		report_row(matrix, n);
+		for (s = 0; s < matrix->nshells; s++) {
+			struct shell *shell = &matrix->shells[s];
+
+			if (n < shell->nresults) {
+				free(shell->results[n].output);
+				shell->results[n].output = NULL;
+			}
+		}
+		shrun_rows_clear(&matrix->rows, n);
+	}
+	fflush(matrix->text.fp);
+}
+
+static void matrix_cb_result(void *priv, const struct shrun_command *command)
+{
+	struct shell *shell = priv;
+	struct matrix *matrix = shell->matrix;
+	struct result *result;
+
+	if (shell->nresults == shell->size) {
+		size_t size = shell->size ? shell->size * 2 : 16;
+
+		result = realloc(shell->results, size * sizeof(*result));
+		if (!result)
+			goto fail;
+		shell->results = result;
+		shell->size = size;
+	}
+	if (shell->nresults == matrix->rows.n &&
+	    shrun_rows_add(&matrix->rows, command) != 0)
+		goto fail;
+	result = &shell->results[shell->nresults];
+	result->lineno = command->lineno;
+	result->status = command->status;
+	result->passed = command->passed;
+	result->output = shrun_copy(command->output, command->output_len);
+	result->output_len = command->output_len;
+	if (!result->output)
+		goto fail;
+	shell->nresults++;
+	report_rows(matrix);
+	return;
+
+fail:
+	matrix->error = 1;
+}
+
+static void matrix_cb_end(void *priv, const struct shrun_summary *summary)
+{
+	struct shell *shell = priv;
+
+	shell->done = 1;
+	shell->summary = *summary;
+	report_rows(shell->matrix);
+}
+
+const struct shrun_callbacks matrix_callbacks = {
+	.result = matrix_cb_result,
+	.end = matrix_cb_end,
+};
+
+/*
+  Report how each shell did. Returns 0 if all commands passed in all
+  shells, 1 if some failed, and 2 if a shell did not run to the end.
+*/
+int matrix_result(struct matrix *matrix)
+{
+	int s, retval = 0;
+
+	for (s = 0; s < matrix->nshells; s++) {
+		struct shell *shell = &matrix->shells[s];
+
+		fprintf(matrix->text.fp, "%s: ", shell->name);
+		if (shell->summary.end == SHRUN_DONE &&
+		    shell->summary.passed + shell->summary.failed == 0)
+			fprintf(matrix->text.fp, "no commands\n");
+		else
+			shrun_text_callbacks.end(&matrix->text,
+						 &shell->summary);
+		if (!shell->done || shell->summary.end != SHRUN_DONE)
+			retval = 2;
+		else if (shell->summary.failed && retval < 1)
+			retval = 1;
+	}
+	if (matrix->error)
+		retval = 2;
+	return retval;
+}
+
+void matrix_free(struct matrix *matrix)
+{
+	size_t n;
+	int s;
+
+	if (!matrix)
+		return;
+	for (s = 0; s < matrix->nshells; s++) {
+		struct shell *shell = &matrix->shells[s];
+
+		for (n = 0; n < shell->nresults; n++)
+			free(shell->results[n].output);
+		free(shell->results);
+	}
+	shrun_rows_free(&matrix->rows);
+	free(matrix->shells);
+	free(matrix);
+}
@@ -0,0 +1,40 @@
+/*
+  File: matrix.h
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#ifndef __MATRIX_H
+#define __MATRIX_H
+
+#include "shrun.h"
+
+/*
+  Report on a script run under several shells at once: the results of
+  each command are shown once all the shells have run it.
+*/
+
+struct matrix;
+
+extern struct matrix *matrix_new(const char **shells, int nshells,
+				 FILE *fp, int color);
+extern const struct shrun_callbacks matrix_callbacks;
+extern void *matrix_priv(struct matrix *matrix, int n);
+extern int matrix_result(struct matrix *matrix);
+extern void matrix_free(struct matrix *matrix);
+
+#endif  /* __MATRIX_H */
@@ -0,0 +1,384 @@
+/*
+  File: metrics.c
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+/*
+  Scripts are labeled by their path as given, and commands by their
+  script and the line they start on (first_lineno). The run times of a
+  command go into a histogram: one observation per run, so benchmarked
+  commands fill it with all their runs. A script given more than once
+  keeps one set of series: the histograms add up all runs, and the other
+  values are those of the last run.
+
+  The file is written under a temporary name and renamed into place, so
+  that a textfile collector never sees it half written.
+*/
+
+static const double buckets[] = {
+	0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10
+};
+static const char *const bucket_names[] = {
+	"0.001", "0.005", "0.01", "0.05", "0.1", "0.5", "1.0", "5.0", "10.0",
+	"+Inf"
+};
+#define BUCKETS (sizeof(buckets) / sizeof(*buckets))
+
+struct histogram {
+	unsigned long count[BUCKETS + 1];  /* per bucket, not cumulative */
+	unsigned long n;
+	double sum;
+};
+
+struct command_metrics {
+	unsigned int lineno;
+	int passed, timed_out;
+	struct histogram runs;
+};
+
+struct script_metrics {
+	char *name;
+	int done, passed;
+	double duration;
+	struct command_metrics *commands;	/* by line number */
+	size_t ncommands, commands_size;
+};
+
+static char *metrics_file;
+static struct script_metrics *scripts;
+static size_t nscripts, scripts_size;
+static struct histogram pending;
+
+int metrics_open(const char *filename)
+{
+	metrics_file = strdup(filename);
+	return metrics_file ? 0 : -1;
+}
+
+static void observe(struct histogram *histogram, double duration)
+{
+	size_t n;
+
+	for (n = 0; n < BUCKETS; n++) {
+		if (duration <= buckets[n])
+			break;
+	}
+	histogram->count[n]++;
+	histogram->n++;
+	histogram->sum += duration;
+}
+
+void metrics_run(double duration)
+{
+	if (metrics_file)
+		observe(&pending, duration);
+}
+
+static void merge(struct histogram *histogram, const struct histogram *runs)
+{
+	size_t n;
+
+	for (n = 0; n <= BUCKETS; n++)
+		histogram->count[n] += runs->count[n];
+	histogram->n += runs->n;
+	histogram->sum += runs->sum;
+}
+
+static struct script_metrics *find_script(const char *name)
+{
+	struct script_metrics *script;
+	size_t n;
+
+	for (n = nscripts; n > 0; n--) {
+		if (strcmp(scripts[n - 1].name, name) == 0)
+			return &scripts[n - 1];
+	}
+	if (nscripts == scripts_size) {
+		size_t size = scripts_size ? scripts_size * 2 : 16;
+
+		script = realloc(scripts, size * sizeof(*script));
+		if (!script)
+			return NULL;
+		scripts = script;
+		scripts_size = size;
+	}
+	script = &scripts[nscripts];
+	memset(script, 0, sizeof(*script));
+	script->name = strdup(name);
+	if (!script->name)
+		return NULL;
+	nscripts++;
+	return script;
+}
+
+/*
+  The command of script at line lineno, added if it is not there yet. The
+  commands come in the order of their lines, except when a script runs
+  again.
+*/
+static struct command_metrics *find_command(struct script_metrics *script,
+					    unsigned int lineno)
+{
+	struct command_metrics *c;
+	size_t low = 0, high = script->ncommands;
+
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+
+		if (script->commands[mid].lineno < lineno)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if (low < script->ncommands && script->commands[low].lineno == lineno)
+		return &script->commands[low];
+	if (script->ncommands == script->commands_size) {
+		size_t size = script->commands_size ?
+			      script->commands_size * 2 : 16;
+
+		c = realloc(script->commands, size * sizeof(*c));
+		if (!c)
+			return NULL;
+		script->commands = c;
+		script->commands_size = size;
+	}
+	c = &script->commands[low];
+	memmove(c + 1, c, (script->ncommands - low) * sizeof(*c));
+	memset(c, 0, sizeof(*c));
+	c->lineno = lineno;
+	script->ncommands++;
+	return c;
+}
+
+void metrics_command(const char *name, const struct shrun_command *command)
+{
+	struct script_metrics *script;
+	struct command_metrics *c;
+
+	if (!metrics_file)
+		return;
+	script = find_script(name);
+	if (!script)
+		goto out;
+	c = find_command(script, command->lineno);
+	if (!c)
+		goto out;
+	c->passed = command->passed;
+	c->timed_out = (command->status == SHRUN_TIMEOUT);
+	/* Without runs (as when applying a recording), the command is one. */
+	if (!pending.n)
+		observe(&pending, command->duration);
+	merge(&c->runs, &pending);
+out:
+	memset(&pending, 0, sizeof(pending));
+}
+
+void metrics_script(const char *name, double duration, int status)
+{
+	struct script_metrics *script;
+
+	if (!metrics_file)
+		return;
+	script = find_script(name);
+	if (!script)
+		return;
+	script->done = 1;
+	script->passed = (status == 0);
+	script->duration = duration;
+}
+
+static void write_label(FILE *fp, const char *value)
+{
+	for (; *value; value++) {
+		if (*value == '\\' || *value == '"')
+			fprintf(fp, "\\%c", *value);
+		else if (*value == '\n')
+			fputs("\\n", fp);
+		else
+			putc(*value, fp);
+	}
+}
+
+static void write_family(FILE *fp, const char *name, const char *type,
+			 const char *help)
+{
+	fprintf(fp, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+static void write_script_labels(FILE *fp, const char *metric, size_t n)
+{
+	fprintf(fp, "%s{script=\"", metric);
+	write_label(fp, scripts[n].name);
+	fputs("\"", fp);
+}
+
+static void write_command_labels(FILE *fp, const char *metric, size_t n,
+				 size_t c)
+{
+	write_script_labels(fp, metric, n);
+	fprintf(fp, ",first_lineno=\"%u\"", scripts[n].commands[c].lineno);
+}
+
+/* How many commands of script n passed, failed, and timed out. */
+static void count_commands(size_t n, unsigned int *passed,
+			   unsigned int *failed, unsigned int *timeouts)
+{
+	size_t c;
+
+	*passed = *failed = *timeouts = 0;
+	for (c = 0; c < scripts[n].ncommands; c++) {
+		if (scripts[n].commands[c].passed)
+			(*passed)++;
+		else
+			(*failed)++;
+		if (scripts[n].commands[c].timed_out)
+			(*timeouts)++;
+	}
+}
+
+static void write_metrics(FILE *fp)
+{
+	unsigned int passed, failed, timeouts;
+	size_t n, c, b;
+
+	write_family(fp, "shrun_script_passed", "gauge",
+		     "Whether all commands of the script passed.");
+	for (n = 0; n < nscripts; n++) {
+		if (!scripts[n].done)
+			continue;
+		write_script_labels(fp, "shrun_script_passed", n);
+		fprintf(fp, "} %d\n", scripts[n].passed);
+	}
+	write_family(fp, "shrun_script_duration_seconds", "gauge",
+		     "How long the script took.");
+	for (n = 0; n < nscripts; n++) {
+		if (!scripts[n].done)
+			continue;
+		write_script_labels(fp, "shrun_script_duration_seconds", n);
+		fprintf(fp, "} %.6f\n", scripts[n].duration);
+	}
+	write_family(fp, "shrun_script_commands", "gauge",
+		     "Commands of the script that passed and failed.");
+	for (n = 0; n < nscripts; n++) {
+		count_commands(n, &passed, &failed, &timeouts);
+		write_script_labels(fp, "shrun_script_commands", n);
+		fprintf(fp, ",result=\"passed\"} %u\n", passed);
+		write_script_labels(fp, "shrun_script_commands", n);
+		fprintf(fp, ",result=\"failed\"} %u\n", failed);
+	}
+	write_family(fp, "shrun_script_timeouts", "gauge",
+		     "Commands of the script that timed out.");
+	for (n = 0; n < nscripts; n++) {
+		count_commands(n, &passed, &failed, &timeouts);
+		write_script_labels(fp, "shrun_script_timeouts", n);
+		fprintf(fp, "} %u\n", timeouts);
+	}
+
+	write_family(fp, "shrun_command_passed", "gauge",
+		     "Whether the command passed.");
+	for (n = 0; n < nscripts; n++) {
+		for (c = 0; c < scripts[n].ncommands; c++) {
+			write_command_labels(fp, "shrun_command_passed", n, c);
+			fprintf(fp, "} %d\n", scripts[n].commands[c].passed);
+		}
+	}
+	write_family(fp, "shrun_command_duration_seconds", "histogram",
+		     "Run times of the command.");
+	for (n = 0; n < nscripts; n++) {
+		for (c = 0; c < scripts[n].ncommands; c++) {
+			struct histogram *runs = &scripts[n].commands[c].runs;
+			unsigned long count = 0;
+
+			for (b = 0; b <= BUCKETS; b++) {
+				count += runs->count[b];
+				write_command_labels(fp,
+					"shrun_command_duration_seconds_bucket",
+					n, c);
+				fprintf(fp, ",le=\"%s\"} %lu\n",
+					bucket_names[b], count);
+			}
+			write_command_labels(fp,
+				"shrun_command_duration_seconds_count", n, c);
+			fprintf(fp, "} %lu\n", runs->n);
+			write_command_labels(fp,
+				"shrun_command_duration_seconds_sum", n, c);
+			fprintf(fp, "} %.6f\n", runs->sum);
+		}
+	}
+
+	shrun_stats_write(fp, SHRUN_STATS_OPENMETRICS);
+	fputs("# EOF\n", fp);
+}
+
+int metrics_close(void)
+{
+	char *tmpfile = NULL;
+	int fd, retval = -1;
+	size_t n;
+	FILE *fp;
+
+	if (!metrics_file)
+		return 0;
+	tmpfile = malloc(strlen(metrics_file) + 8);
+	if (!tmpfile)
+		goto out;
+	sprintf(tmpfile, "%s.XXXXXX", metrics_file);
+	fd = mkstemp(tmpfile);
+	if (fd < 0)
+		goto out;
+	fchmod(fd, 0644);
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		unlink(tmpfile);
+		goto out;
+	}
+	write_metrics(fp);
+	if (ferror(fp)) {
+		fclose(fp);
+		unlink(tmpfile);
+		goto out;
+	}
+	if (fclose(fp) != 0 || rename(tmpfile, metrics_file) != 0) {
+		unlink(tmpfile);
+		goto out;
+	}
+	retval = 0;
+
+out:
+	free(tmpfile);
+	for (n = 0; n < nscripts; n++) {
+		free(scripts[n].name);
+		free(scripts[n].commands);
+	}
+	free(scripts);
+	scripts = NULL;
+	nscripts = scripts_size = 0;
+	free(metrics_file);
+	metrics_file = NULL;
+	return retval;
+}
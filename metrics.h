@@ -0,0 +1,39 @@
+/*
+  File: metrics.h
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include "shrun.h"
+
+/*
+  Results and run times of scripts and commands in the OpenMetrics text
+  format (see --metrics), written out at the end.
+*/
+
+extern int metrics_open(const char *filename);
+/* One run of the next command has completed. */
+extern void metrics_run(double duration);
+extern void metrics_command(const char *script,
+			    const struct shrun_command *command);
+extern void metrics_script(const char *script, double duration, int status);
+extern int metrics_close(void);
+
+#endif  /* __METRICS_H */
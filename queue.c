@@ -19,22 +19,107 @@
 
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "queue.h"
+#include "stats.h"
+
+/*
+  Queues start out small and grow by doubling, so that idle sessions cost
+  little. When a queue which has grown beyond QUEUE_KEEP is reset, its
+  buffer is given back; most commands and their output are small, and the
+  odd large one should not pin its memory for the rest of the script.
+*/
+#define QUEUE_MIN 256
+#define QUEUE_KEEP (16 << 10)
 
 void queue_init(struct queue *queue)
 {
 	queue->buffer = queue->read = queue->write = NULL;
 	queue->size = 0;
+	queue->limit = 0;
+	queue->peak = 0;
+	queue->fd = -1;
+}
+
+/*
+  Keep at most limit bytes of the queue in memory (0 means no limit).
+  Beyond that, the queue is backed by an unlinked temporary file which is
+  mapped into memory, so that the kernel can write the data out instead of
+  having to keep it around.
+*/
+void queue_set_limit(struct queue *queue, size_t limit)
+{
+	queue->limit = limit;
+}
+
+static void queue_free(struct queue *queue)
+{
+	if (queue->fd != -1) {
+		munmap(queue->buffer, queue->size);
+		close(queue->fd);
+		queue->fd = -1;
+	} else
+		free(queue->buffer);
 }
 
 void queue_destroy(struct queue *queue)
 {
-	free(queue->buffer);
+	queue_free(queue);
+}
+
+static int spill_file(void)
+{
+	const char *tmpdir = getenv("TMPDIR");
+	char *template;
+	int fd;
+
+	if (!tmpdir || !*tmpdir)
+		tmpdir = "/tmp";
+	template = malloc(strlen(tmpdir) + 14);
+	if (!template)
+		return -1;
+	sprintf(template, "%s/shrun.XXXXXX", tmpdir);
+	fd = mkstemp(template);
+	if (fd != -1)
+		unlink(template);
+	free(template);
+	return fd;
+}
+
+static char *queue_spill(struct queue *queue, size_t size)
+{
+	char *buffer;
+	int fd = queue->fd;
+
+	if (fd == -1) {
+		fd = spill_file();
+		if (fd == -1)
+			return NULL;
+	}
+	if (ftruncate(fd, size) != 0)
+		goto fail;
+	buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (buffer == MAP_FAILED)
+		goto fail;
+	if (queue->fd == -1) {
+		if (queue->buffer)
+			memcpy(buffer, queue->buffer,
+			       queue->write - queue->buffer);
+		free(queue->buffer);
+		queue->fd = fd;
+	} else
+		munmap(queue->buffer, queue->size);
+	return buffer;
+
+fail:
+	if (queue->fd == -1)
+		close(fd);
+	return NULL;
 }
 
 char *queue_write_pos(struct queue *queue, size_t size, ssize_t *pavail)
@@ -49,17 +134,27 @@ char *queue_write_pos(struct queue *queue, size_t size, ssize_t *pavail)
 		if (queue->read != queue->buffer) {
 			memmove(queue->buffer, queue->read,
 				queue->write - queue->read);
+			stats.moved_bytes += queue->write - queue->read;
 			queue->write -= queue->read - queue->buffer;
 			queue->read = queue->buffer;
 		} else {
-			if (!queue->size)
-				queue->size = 16384;
-			while (queue->size - used < size)
-				queue->size *= 2;
-
-			buffer = realloc(queue->buffer, queue->size);
+			size_t new_size = queue->size;
+
+			if (!new_size)
+				new_size = QUEUE_MIN;
+			while (new_size - used < size)
+				new_size *= 2;
+
+			if (queue->limit && new_size > queue->limit) {
+				buffer = queue_spill(queue, new_size);
+				stats.spills++;
+			} else {
+				buffer = realloc(queue->buffer, new_size);
+				stats.reallocs++;
+			}
 			if (!buffer)
 				return NULL;
+			queue->size = new_size;
 			queue->read += buffer - queue->buffer;
 			queue->write += buffer - queue->buffer;
 			queue->buffer = buffer;
@@ -74,6 +169,8 @@ char *queue_write_pos(struct queue *queue, size_t size, ssize_t *pavail)
 void queue_advance_write(struct queue *queue, size_t size)
 {
 	queue->write += size;
+	if (queue->write - queue->read > queue->peak)
+		queue->peak = queue->write - queue->read;
 }
 
 int queue_empty(struct queue *queue)
@@ -102,6 +199,12 @@ void queue_advance_read(struct queue *queue, size_t size)
 
 void queue_reset(struct queue *queue)
 {
+	if (queue->fd != -1 || queue->size > QUEUE_KEEP) {
+		/* Give the temporary file or the large buffer back. */
+		queue_free(queue);
+		queue->buffer = NULL;
+		queue->size = 0;
+	}
 	queue->write = queue->read = queue->buffer;
 }
 
@@ -22,10 +22,13 @@
 
 struct queue {
 	char *buffer, *read, *write;
-	size_t size;
+	size_t size, limit;
+	size_t peak;			/* longest the queue has been */
+	int fd;
 };
 
 extern void queue_init(struct queue *queue);
+extern void queue_set_limit(struct queue *queue, size_t limit);
 extern void queue_destroy(struct queue *queue);
 extern char *queue_write_pos(struct queue *queue, size_t size, ssize_t *pavail);
 extern void queue_advance_write(struct queue *queue, size_t size);
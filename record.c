@@ -0,0 +1,299 @@
+/*
+  File: record.c
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "record.h"
+
+/*
+  A recording starts with RECORD_MAGIC, followed by one entry per script
+  and per command. All numbers are little endian.
+
+    'S' <hash:8> <name length:4> <name>
+    'C' <line:4> <status:1> <exit status:4> <duration in ns:8>
+        <command length:4> <command> <output length:8> <output>
+
+  The hash identifies the contents of the script file (FNV-1a); scripts
+  are found by their contents rather than by their name, so a recording
+  can be applied in another directory or on another machine. The commands
+  of a script follow its 'S' entry.
+*/
+
+#define RECORD_MAGIC "shrun-record-1\n"
+#define MAGIC_LEN (sizeof(RECORD_MAGIC) - 1)
+
+static FILE *record_fp;
+
+static const unsigned char *log_buf;	/* mapped */
+static size_t log_size;
+static size_t *commands;		/* of the script to apply */
+static size_t ncommands, size, next_command;
+
+static int script_hash(const char *script, uint64_t *hash)
+{
+	unsigned char buf[65536];
+	ssize_t sz, n;
+	int fd;
+
+	fd = open(script, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	*hash = 14695981039346656037ULL;
+	while ((sz = read(fd, buf, sizeof(buf))) > 0) {
+		for (n = 0; n < sz; n++) {
+			*hash ^= buf[n];
+			*hash *= 1099511628211ULL;
+		}
+	}
+	close(fd);
+	return sz < 0 ? -1 : 0;
+}
+
+static void put(uint64_t value, int bytes)
+{
+	while (bytes--) {
+		putc(value & 0xff, record_fp);
+		value >>= 8;
+	}
+}
+
+static uint64_t get(size_t *pos, int bytes)
+{
+	uint64_t value = 0;
+	int n;
+
+	for (n = 0; n < bytes; n++)
+		value |= (uint64_t)log_buf[*pos + n] << (8 * n);
+	*pos += bytes;
+	return value;
+}
+
+int record_open(const char *filename)
+{
+	record_fp = fopen(filename, "w");
+	if (!record_fp)
+		return -1;
+	fputs(RECORD_MAGIC, record_fp);
+	return 0;
+}
+
+int record_script(const char *script)
+{
+	uint64_t hash;
+
+	if (!record_fp)
+		return 0;
+	if (script_hash(script, &hash) != 0)
+		return -1;
+	putc('S', record_fp);
+	put(hash, 8);
+	put(strlen(script), 4);
+	fputs(script, record_fp);
+	return 0;
+}
+
+void record_command(const struct shrun_command *command)
+{
+	if (!record_fp)
+		return;
+	putc('C', record_fp);
+	put(command->lineno, 4);
+	put(command->status, 1);
+	put((uint32_t)command->exit_status, 4);
+	put(command->duration * 1e9, 8);
+	put(command->command_len, 4);
+	fwrite(command->command, 1, command->command_len, record_fp);
+	put(command->output_len, 8);
+	fwrite(command->output, 1, command->output_len, record_fp);
+}
+
+int record_close(void)
+{
+	int retval;
+
+	if (!record_fp)
+		return 0;
+	retval = ferror(record_fp) ? -1 : 0;
+	if (fclose(record_fp) != 0)
+		retval = -1;
+	record_fp = NULL;
+	return retval;
+}
+
+int replay_open(const char *filename)
+{
+	struct stat st;
+	void *buf;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	buf = mmap(NULL, st.st_size ? st.st_size : 1, PROT_READ, MAP_PRIVATE,
+		   fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED)
+		return -1;
+	log_buf = buf;
+	log_size = st.st_size;
+	if (log_size < MAGIC_LEN ||
+	    memcmp(log_buf, RECORD_MAGIC, MAGIC_LEN) != 0) {
+		replay_close();
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  Skip over the entry at *pos. Returns its type, or -1 if the entry is
+  cut short.
+*/
+static int next_entry(size_t *pos)
+{
+	size_t left = log_size - *pos;
+	uint64_t len;
+	int type;
+
+	if (left < 1)
+		return -1;
+	type = log_buf[*pos];
+	(*pos)++;
+	left--;
+	switch(type) {
+	case 'S':
+		if (left < 12)
+			return -1;
+		*pos += 8;
+		len = get(pos, 4);
+		if (len > left - 12)
+			return -1;
+		*pos += len;
+		break;
+
+	case 'C':
+		if (left < 21)
+			return -1;
+		*pos += 17;
+		len = get(pos, 4);
+		if (len > left - 21 || left - 21 - len < 8)
+			return -1;
+		*pos += len;
+		left -= 21 + len;
+		len = get(pos, 8);
+		if (len > left - 8)
+			return -1;
+		*pos += len;
+		break;
+
+	default:
+		return -1;
+	}
+	return type;
+}
+
+int replay_script(const char *script)
+{
+	size_t pos = MAGIC_LEN, start;
+	uint64_t hash;
+	int type, current = 0, found = 0;
+
+	ncommands = next_command = 0;
+	if (script_hash(script, &hash) != 0)
+		return -1;
+	/* The last recording of the script counts. */
+	for (;;) {
+		start = pos;
+		type = next_entry(&pos);
+		if (type < 0)
+			break;
+		if (type == 'S') {
+			size_t p = start + 1;
+
+			current = (get(&p, 8) == hash);
+			if (current) {
+				found = 1;
+				ncommands = 0;
+			}
+		} else if (current) {
+			if (ncommands == size) {
+				size_t *c, sz = size ? size * 2 : 64;
+
+				c = realloc(commands, sz * sizeof(*commands));
+				if (!c)
+					return -1;
+				commands = c;
+				size = sz;
+			}
+			commands[ncommands++] = start;
+		}
+	}
+	/* A recording that was cut short ends with the last whole entry. */
+	return found ? 0 : -1;
+}
+
+int replay_command(void *priv, struct shrun_command *command)
+{
+	size_t pos, len;
+
+	if (next_command == ncommands)
+		return 0;
+	pos = commands[next_command++] + 1;
+	if (get(&pos, 4) != command->lineno) {
+		errno = EINVAL;
+		return -1;
+	}
+	command->status = get(&pos, 1);
+	command->exit_status = (int32_t)get(&pos, 4);
+	command->duration = get(&pos, 8) / 1e9;
+	len = get(&pos, 4);
+	if (len != command->command_len ||
+	    memcmp(log_buf + pos, command->command, len) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	pos += len;
+	command->output_len = get(&pos, 8);
+	command->output = (const char *)log_buf + pos;
+	return 1;
+}
+
+void replay_close(void)
+{
+	if (log_buf)
+		munmap((void *)log_buf, log_size ? log_size : 1);
+	log_buf = NULL;
+	free(commands);
+	commands = NULL;
+	ncommands = size = next_command = 0;
+}
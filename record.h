@@ -0,0 +1,42 @@
+/*
+  File: record.h
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#ifndef __RECORD_H
+#define __RECORD_H
+
+#include "shrun.h"
+
+/*
+  Recordings of runs (see --record), and taking the results of commands
+  from them instead of running the commands again (see --apply).
+*/
+
+extern int record_open(const char *filename);
+extern int record_script(const char *script);
+extern void record_command(const struct shrun_command *command);
+extern int record_close(void);
+
+extern int replay_open(const char *filename);
+/* Returns -1 if the script was not recorded, or has changed since. */
+extern int replay_script(const char *script);
+extern int replay_command(void *priv, struct shrun_command *command);
+extern void replay_close(void);
+
+#endif  /* __RECORD_H */
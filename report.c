@@ -0,0 +1,365 @@
+/*
+  File: report.c
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shrun.h"
+
+void shrun_text_report_init(struct shrun_text_report *report, FILE *fp,
+			    int color)
+{
+	report->fp = fp;
+	if (color) {
+		report->red = "\033[31m\033[1m";
+		report->green = "\033[32m";
+		report->clear = "\033[m";
+	} else
+		report->red = report->green = report->clear = "";
+}
+
+void shrun_text_report_command(struct shrun_text_report *report,
+			       unsigned int lineno,
+			       const char *command, size_t len)
+{
+	const char *newline;
+
+	newline = memchr(command, '\n', len);
+	if (!newline)
+		newline = command + len - 1;
+
+	fprintf(report->fp, "[%u] $ %.*s%s -- ",
+		lineno, (int)(newline - command), command,
+		(newline == command + len - 1) ? "" : "...");
+}
+
+static void report_begin(void *priv, const struct shrun_command *command)
+{
+	struct shrun_text_report *report = priv;
+
+	shrun_text_report_command(report, command->lineno,
+				  command->command, command->command_len);
+	fflush(report->fp);
+}
+
+const char *shrun_status_name(enum shrun_status status)
+{
+	switch(status) {
+	case SHRUN_OK:
+		return "ok";
+	case SHRUN_FAILED:
+		return "failed";
+	case SHRUN_TIMEOUT:
+		return "timed out";
+	case SHRUN_WAITING:
+		return "waiting for input";
+	case SHRUN_OUTPUT_LIMIT:
+		return "output limit exceeded";
+	case SHRUN_EXITED:
+		return "shell exited";
+	case SHRUN_SHORT_RESULT:
+		break;
+	}
+	return "short result";
+}
+
+static size_t line_len(const char *buf, const struct shrun_lines *lines,
+		       size_t n)
+{
+	size_t len = lines->start[n + 1] - lines->start[n];
+
+	if (len && buf[lines->start[n + 1] - 1] == '\n')
+		len--;
+	return len;
+}
+
+void shrun_text_report_diff(struct shrun_text_report *report,
+			    const char *buf1, const struct shrun_lines *lines1,
+			    const char *buf2, const struct shrun_lines *lines2)
+{
+	size_t width = 0, n;
+
+	for (n = 0; n < lines1->n; n++) {
+		if (line_len(buf1, lines1, n) > width)
+			width = line_len(buf1, lines1, n);
+	}
+	for (n = 0; n < lines2->n; n++) {
+		if (line_len(buf2, lines2, n) > width)
+			width = line_len(buf2, lines2, n);
+	}
+
+	for (n = 0; n < lines1->n || n < lines2->n; n++) {
+		const char *l1 = "~", *l2 = "~";
+		size_t lz1 = 1, lz2 = 1;
+		int eq;
+
+		if (n < lines1->n) {
+			l1 = buf1 + lines1->start[n];
+			lz1 = line_len(buf1, lines1, n);
+		}
+		if (n < lines2->n) {
+			l2 = buf2 + lines2->start[n];
+			lz2 = line_len(buf2, lines2, n);
+		}
+		eq = (n < lines1->n && n < lines2->n &&
+		      lz1 == lz2 && memcmp(l1, l2, lz1) == 0);
+
+		fprintf(report->fp, "%s%-*.*s%s %c %s%.*s%s\n",
+			eq ? "" : report->red, (int)width, (int)lz1, l1,
+			report->clear, eq ? '|' : '?',
+			eq ? "" : report->green, (int)lz2, l2, report->clear);
+	}
+}
+
+int shrun_text_report_diff_buffers(struct shrun_text_report *report,
+				   const char *buf1, size_t sz1,
+				   const char *buf2, size_t sz2)
+{
+	struct shrun_lines lines1 = { }, lines2 = { };
+	int retval = -1;
+
+	if (shrun_lines_index(&lines1, buf1, sz1) == 0 &&
+	    shrun_lines_index(&lines2, buf2, sz2) == 0) {
+		shrun_text_report_diff(report, buf1, &lines1, buf2, &lines2);
+		retval = 0;
+	}
+	shrun_lines_free(&lines1);
+	shrun_lines_free(&lines2);
+	return retval;
+}
+
+char *shrun_copy(const char *buf, size_t sz)
+{
+	char *p = malloc(sz + 1);
+
+	if (p) {
+		memcpy(p, buf, sz);
+		p[sz] = '\0';
+	}
+	return p;
+}
+
+int shrun_rows_add(struct shrun_rows *rows,
+		   const struct shrun_command *command)
+{
+	struct shrun_row *row;
+
+	if (rows->n == rows->size) {
+		size_t size = rows->size ? rows->size * 2 : 16;
+
+		row = realloc(rows->row, size * sizeof(*row));
+		if (!row)
+			return -1;
+		rows->row = row;
+		rows->size = size;
+	}
+	row = &rows->row[rows->n];
+	row->command = shrun_copy(command->command, command->command_len);
+	row->command_len = command->command_len;
+	row->expected = shrun_copy(command->expected, command->expected_len);
+	row->expected_len = command->expected_len;
+	if (!row->command || !row->expected) {
+		free(row->command);
+		free(row->expected);
+		return -1;
+	}
+	rows->n++;
+	return 0;
+}
+
+void shrun_rows_clear(struct shrun_rows *rows, size_t n)
+{
+	free(rows->row[n].command);
+	free(rows->row[n].expected);
+	rows->row[n].command = rows->row[n].expected = NULL;
+}
+
+void shrun_rows_free(struct shrun_rows *rows)
+{
+	size_t n;
+
+	for (n = 0; n < rows->n; n++)
+		shrun_rows_clear(rows, n);
+	free(rows->row);
+	rows->row = NULL;
+	rows->n = rows->size = 0;
+}
+
+static void report_bench(struct shrun_text_report *report,
+			 const struct shrun_bench *bench)
+{
+	fprintf(report->fp, "%u run%s: min %.3fms, median %.3fms, "
+		"p95 %.3fms, stddev %.3fms\n",
+		bench->runs, bench->runs == 1 ? "" : "s",
+		bench->stat[SHRUN_MIN] * 1e3, bench->stat[SHRUN_MEDIAN] * 1e3,
+		bench->stat[SHRUN_P95] * 1e3, bench->stat[SHRUN_STDDEV] * 1e3);
+	if (bench->budget_exceeded)
+		fprintf(report->fp, "%sbudget exceeded: %s %.3fms, "
+			"expected %s%s\n", report->red,
+			shrun_stat_names[bench->budget_stat],
+			bench->stat[bench->budget_stat] * 1e3,
+			bench->budget, report->clear);
+}
+
+static void report_counters(struct shrun_text_report *report,
+			    const struct shrun_counters *counters)
+{
+	unsigned int n;
+
+	fprintf(report->fp, "counters:");
+	for (n = 0; n < counters->n; n++) {
+		const char *name = counters->name[n];
+		unsigned long long value = counters->value[n];
+
+		fprintf(report->fp, "%s %s ", n ? "," : "", name);
+		if (value == SHRUN_NOT_COUNTED)
+			fprintf(report->fp, "not counted");
+		else if (strstr(name, "-clock"))
+			fprintf(report->fp, "%.3fms", value / 1e6);
+		else
+			fprintf(report->fp, "%llu", value);
+	}
+	fprintf(report->fp, "\n");
+}
+
+static void report_result(void *priv, const struct shrun_command *command)
+{
+	struct shrun_text_report *report = priv;
+
+	switch(command->status) {
+	case SHRUN_OK:
+		fprintf(report->fp, "%s%s%s\n",
+			report->green, "ok", report->clear);
+		break;
+
+	case SHRUN_SHORT_RESULT:
+		fprintf(report->fp, "%s%s%s\n",
+			report->red, "short result", report->clear);
+		break;
+
+	case SHRUN_TIMEOUT:
+		fprintf(report->fp, "%s%s%s\n",
+			report->red, "command timed out", report->clear);
+		break;
+
+	case SHRUN_WAITING:
+		fprintf(report->fp, "%s%s%s\n", report->red,
+			"command is waiting for input", report->clear);
+		break;
+
+	case SHRUN_OUTPUT_LIMIT:
+		fprintf(report->fp, "%s%s%s\n",
+			report->red, "output limit exceeded", report->clear);
+		break;
+
+	case SHRUN_EXITED:
+		if (command->exit_status == -1)
+			fprintf(report->fp, "%s%s%s\n",
+				report->red, "shell exited", report->clear);
+		else if (WIFSIGNALED(command->exit_status))
+			fprintf(report->fp, "%sshell killed by signal %d%s\n",
+				report->red, WTERMSIG(command->exit_status),
+				report->clear);
+		else
+			fprintf(report->fp, "%sshell exited with status %d%s\n",
+				report->red, WEXITSTATUS(command->exit_status),
+				report->clear);
+		break;
+
+	case SHRUN_FAILED:
+		fprintf(report->fp, "%s%s%s\n",
+			report->red, "failed", report->clear);
+		shrun_text_report_diff(report,
+				       command->output, command->output_lines,
+				       command->expected, command->expected_lines);
+		break;
+	}
+	if (command->bench)
+		report_bench(report, command->bench);
+	if (command->counters)
+		report_counters(report, command->counters);
+}
+
+static void report_interactive(void *priv)
+{
+	struct shrun_text_report *report = priv;
+
+	fprintf(report->fp, "%sinteractive; press ^D to continue%s\n",
+		report->red, report->clear);
+	fflush(report->fp);
+}
+
+static void report_end(void *priv, const struct shrun_summary *summary)
+{
+	struct shrun_text_report *report = priv;
+	unsigned int total = summary->passed + summary->failed;
+
+	switch(summary->end) {
+	case SHRUN_DONE:
+		if (total > 0)
+			fprintf(report->fp,
+				"%s%u commands (%u passed, %u failed)%s\n",
+				summary->failed == 0 ? report->green :
+						       report->red,
+				total, summary->passed, summary->failed,
+				report->clear);
+		break;
+
+	case SHRUN_TIMED_OUT:
+		fprintf(report->fp, "%scommand timed out%s\n",
+			report->red, report->clear);
+		break;
+
+	case SHRUN_INPUT_WAIT:
+		fprintf(report->fp, "%scommand is waiting for input%s\n",
+			report->red, report->clear);
+		break;
+
+	case SHRUN_OUTPUT_EXCEEDED:
+		fprintf(report->fp, "%soutput limit exceeded%s\n",
+			report->red, report->clear);
+		break;
+
+	case SHRUN_INTERRUPTED:
+		fprintf(report->fp, "%sinterrupted%s\n",
+			report->red, report->clear);
+		break;
+
+	case SHRUN_UNKNOWN_CONTROL:
+		fprintf(report->fp, "%sunknown control command%s\n",
+			report->red, report->clear);
+		break;
+
+	case SHRUN_ERROR:
+		fprintf(report->fp, "%s%s%s\n",
+			report->red, strerror(summary->error), report->clear);
+		break;
+	}
+	fflush(report->fp);
+}
+
+const struct shrun_callbacks shrun_text_callbacks = {
+	.begin = report_begin,
+	.result = report_result,
+	.interactive = report_interactive,
+	.end = report_end,
+};
@@ -0,0 +1,1880 @@
+/*
+  File: session.c
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <termios.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+
+#include "shrun.h"
+#include "queue.h"
+#include "pty_fork.h"
+#include "trace.h"
+#include "isolate.h"
+#include "stats.h"
+#include "tty_wait.h"
+#include "counters.h"
+#include "statistics.h"
+
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+enum { PIPE_READ, PIPE_WRITE };
+
+static const char *control_cmds =
+	"timeout() { echo \"timeout $1\" >&109; }\n"
+	"bench() { echo \"bench $1\" >&109; }\n"
+	"budget() { echo \"budget $1\" >&109; }\n"
+	"span() { echo \"span $*\" >&109; }\n"
+	"setup() { echo setup >&109; }\n";
+
+static const char *end_marker_cmd = "echo $'\\4'\n";
+
+/*
+  Commands with input from a fifo are wrapped in a group which reads from
+  the fifo (through the O_PATH file descriptor 108 which the shell
+  inherits), and which reports when it has opened the fifo.
+*/
+static const char *stdin_begin_cmd = "{ echo stdin >&109; ";
+static const char *stdin_end_cmd = "} </proc/self/fd/108\n";
+
+/*
+  With the file channel, the shell reads commands from file descriptor 106
+  instead of from the terminal, whenever shrun writes a line to file
+  descriptor 107. The end marker follows once the shell has read and run
+  all of the file.
+*/
+static const char *channel_loop =
+	"while read -r REPLY <&107; do . /proc/self/fd/106; echo $'\\4'; done";
+
+/*
+  In canonical mode, the pty only passes lines of up to this length on,
+  and it interprets control characters in the input.
+*/
+#define PTY_LINE_MAX 4095
+
+/* Larger inputs are passed through a fifo with --stdin=auto. */
+#define PTY_INPUT_MAX (64 << 10)
+
+/*
+  How much of the script to read at a time. The script buffer only holds
+  the lines up to the next command, so it does not grow by itself.
+*/
+#define SCRIPT_READ 1024
+
+/*
+  How soon after the last activity to check whether a command is waiting
+  for input, and how far apart the checks may get when it is not.
+*/
+#define INPUT_WAIT_MIN 0.01
+#define INPUT_WAIT_MAX 0.32
+
+/* The processes killed when recovering from a timeout we wait for. */
+#define KILLED_MAX 16
+
+/* How long to wait for a shell to exit once its output has ended. */
+#define REAP_WAIT 0.1
+
+/* Sessions created so far, for their trace thread IDs. */
+static int sessions;
+
+const char *shrun_stat_names[SHRUN_STATS + 1] = {
+	"min", "median", "p95", "max", "mean", "stddev", NULL
+};
+
+struct shrun_session {
+	struct shrun_options options;
+	const struct shrun_callbacks *callbacks;
+	void *priv;
+
+	int script_fd, in, out, control_fd;
+	int stdin_path, stdin_fd, stdin_fifo, stdin_opened;
+	int channel_file, channel_fd;
+	size_t stdin_pos;
+	pid_t pid, shell;
+	dev_t tty;
+	char veof;
+
+	struct queue script, control, testcase, expected, input, output;
+	struct queue command, bench_cmd, setup;
+	struct shrun_lines output_lines, expected_lines;
+	int script_eof, in_eof, testcase_eof, reading_testcase;
+	unsigned int passed, failed;
+	size_t preamble, bench_output;
+	size_t first_lineno, lineno;
+	char *testcase_indent;
+
+	unsigned int bench_runs, bench_run, bench_next;
+	char *bench_budget, *budget_next;
+	double *bench_times, bench_start, run_end;
+	int bench_changed;
+	int paused, resumed;
+	int setup_next, setup_cmd;
+	struct counters counters;
+	struct shrun_counters counts;
+
+	double probe_at, probe_interval;
+	pid_t reader;
+	int eof_sent;
+
+	enum shrun_status recovering;	/* the command's status, or 0 */
+	size_t recover_output;
+	double recover_start;
+	pid_t killed[KILLED_MAX];
+	int nkilled, marker_pending, shell_killed;
+
+	double parse_start, write_start, last_activity, command_start;
+	int trace_commands, trace_spans;	/* trace thread IDs */
+	struct shrun_command replayed;
+
+	int done;
+	enum shrun_end end;
+	int error;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+  Parse a budget like "p95<30ms" into the index of the statistic in
+  shrun_stat_names[] and the limit in seconds.
+*/
+static int parse_budget(const char *str, int *stat, double *limit)
+{
+	const char *lt;
+	char *end;
+	int n;
+
+	lt = strchr(str, '<');
+	if (!lt)
+		return -1;
+	for (n = 0; shrun_stat_names[n]; n++) {
+		if (strlen(shrun_stat_names[n]) == lt - str &&
+		    strncmp(shrun_stat_names[n], str, lt - str) == 0)
+			break;
+	}
+	if (!shrun_stat_names[n])
+		return -1;
+	*limit = strtod(lt + 1, &end);
+	if (end == lt + 1 || *limit < 0)
+		return -1;
+	if (strcmp(end, "s") == 0)
+		;
+	else if (strcmp(end, "ms") == 0)
+		*limit /= 1e3;
+	else if (strcmp(end, "us") == 0)
+		*limit /= 1e6;
+	else if (strcmp(end, "ns") == 0)
+		*limit /= 1e9;
+	else
+		return -1;
+	*stat = n;
+	return 0;
+}
+
+/*
+  Compute the statistics of a benchmarked command, and check them
+  against the budget (if any).
+*/
+static void bench_stats(double *times, unsigned int runs, const char *budget,
+			struct shrun_bench *bench)
+{
+	double sum = 0, sq = 0, limit;
+	unsigned int n;
+	int stat;
+
+	qsort(times, runs, sizeof(*times), compare_doubles);
+	for (n = 0; n < runs; n++)
+		sum += times[n];
+	bench->runs = runs;
+	bench->stat[SHRUN_MEAN] = sum / runs;
+	for (n = 0; n < runs; n++)
+		sq += (times[n] - bench->stat[SHRUN_MEAN]) *
+		      (times[n] - bench->stat[SHRUN_MEAN]);
+	bench->stat[SHRUN_MIN] = times[0];
+	bench->stat[SHRUN_MEDIAN] = (runs & 1) ? times[runs / 2] :
+		(times[runs / 2 - 1] + times[runs / 2]) / 2;
+	bench->stat[SHRUN_P95] = times[(unsigned int)ceil(runs * 0.95) - 1];
+	bench->stat[SHRUN_MAX] = times[runs - 1];
+	bench->stat[SHRUN_STDDEV] = runs > 1 ? sqrt(sq / (runs - 1)) : 0;
+
+	bench->budget = NULL;
+	bench->budget_exceeded = 0;
+	if (budget && parse_budget(budget, &stat, &limit) == 0) {
+		bench->budget = budget;
+		bench->budget_stat = stat;
+		bench->budget_exceeded = bench->stat[stat] >= limit;
+	}
+}
+
+static int append_line(struct queue *queue, const char *line, size_t sz)
+{
+	size_t append_newline = 1;
+	char *buf;
+
+	line++;
+	sz--;
+	if (sz && (*line == ' ')) {
+		line++;
+		sz--;
+	}
+
+	if (sz && line[sz - 1] == '\n')
+		append_newline = 0;
+	buf = queue_write_pos(queue, sz + append_newline, NULL);
+	if (!buf)
+		return -1;
+	memcpy(buf, line, sz);
+	if (append_newline)
+		buf[sz] = '\n';
+	queue_advance_write(queue, sz + append_newline);
+
+	return 0;
+}
+
+static int read_testcase(struct shrun_session *session, int eof)
+{
+	struct queue *script = &session->script,
+		     *testcase = &session->testcase;
+	size_t preamble = session->preamble;
+	FILE *ufp = session->options.update;
+	char *buf;
+	ssize_t sz;
+
+	for (;;) {
+		char *end, *newline, *l;
+
+		buf = queue_read_pos(script, &sz);
+		if (!buf)
+			break;
+		newline = memchr(buf, '\n', sz);
+		if (newline)
+			sz = newline - buf + 1;
+		else if (!eof)
+			break;
+
+		l = buf; end = buf + sz;
+		while (l < end && (*l == ' ' || *l == '\t'))
+			l++;
+		if (l == end || *l == '$' || *l == '\n') {
+			if (queue_length(testcase) > preamble) {
+				eof = 1;
+				goto done;
+			}
+			if (l < end && *l == '$') {
+				char *indent = session->testcase_indent;
+
+				if (l == buf) {
+					free(indent);
+					indent = NULL;
+				} else {
+					indent = realloc(indent, l - buf + 1);
+					if (!indent)
+						return -1;
+					memcpy(indent, buf, l - buf);
+					indent[l - buf] = '\0';
+				}
+				session->testcase_indent = indent;
+
+				session->first_lineno = session->lineno;
+				if (session->options.stop_at <=
+				    session->first_lineno)
+					return 0;
+				if (append_line(testcase, l, end - l) != 0)
+					return -1;
+			}
+		} else if (queue_length(testcase) > preamble) {
+			switch(*l) {
+			case '+':
+				if (append_line(testcase, l, end - l) != 0)
+					return -1;
+				break;
+
+			case '>':
+				if (append_line(&session->expected, l,
+						end - l) != 0)
+					return -1;
+				break;
+
+			case '<':
+				if (append_line(&session->input, l,
+						end - l) != 0)
+					return -1;
+				break;
+			}
+		}
+		if (ufp && l < end && *l != '>') {
+			fwrite(buf, 1, sz, ufp);
+		}
+		queue_advance_read(script, sz);
+		session->lineno++;
+	}
+
+done:
+	return eof;
+}
+
+static int erase_end_marker(struct queue *output)
+{
+	char *buf;
+	ssize_t sz;
+
+	buf = queue_read_pos(output, &sz);
+	if (buf && sz >= 2 && buf[sz - 2] == '\4' && buf[sz - 1] == '\n') {
+		queue_erase_tail(output, 2);
+		return 0;
+	}
+	return -1;
+}
+
+/*
+  Pass the terminal through to the shell until the user presses ^D.
+  This blocks, and is only used when stop_at is set.
+*/
+static int interactive(int in, int out)
+{
+	struct queue input, output;
+	sigset_t sigset;
+	int stdin_eof = 0, interactive_eof = 0, retval = 0;
+
+	sigemptyset(&sigset);
+	queue_init(&input);
+	queue_init(&output);
+
+	for(;;) {
+		fd_set rfds, wfds;
+		int maxfd = 0, retval2;
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		if (!stdin_eof) {
+			FD_SET(STDIN_FILENO, &rfds);
+			maxfd = max(maxfd, STDIN_FILENO + 1);
+		}
+		if (!queue_empty(&input)) {
+			FD_SET(out, &wfds);
+			maxfd = max(maxfd, out + 1);
+		}
+		FD_SET(in, &rfds);
+		maxfd = max(maxfd, in + 1);
+		do {
+			retval2 = pselect(maxfd, &rfds, &wfds, NULL, NULL,
+					  &sigset);
+		} while (retval2 < 0 && errno == EINTR);
+		if (retval2 < 0)
+			break;
+		if (FD_ISSET(STDIN_FILENO, &rfds)) {
+			char *buf;
+			ssize_t sz;
+
+			buf = queue_write_pos(&input, 256, &sz);
+			if (!buf)
+				break;
+			sz = read(STDIN_FILENO, buf, sz);
+			if (sz < 0)
+				break;
+			queue_advance_write(&input, sz);
+			if (sz == 0) {
+				stdin_eof = 1;
+
+				if (queue_append(&input, end_marker_cmd) != 0)
+					break;
+			}
+		}
+		if (FD_ISSET(out, &wfds)) {
+			char *buf;
+			ssize_t sz;
+
+			buf = queue_read_pos(&input, &sz);
+			if (buf) {
+				sz = write(out, buf, sz);
+				if (sz < 0)
+					break;
+			}
+			queue_advance_read(&input, sz);
+		}
+		if (FD_ISSET(in, &rfds)) {
+			char *buf;
+			ssize_t sz;
+
+			buf = queue_write_pos(&output, 256, &sz);
+			if (!buf)
+				break;
+			sz = read(in, buf, sz);
+			if (sz <= 0)
+				break;
+			queue_advance_write(&output, sz);
+
+			if (erase_end_marker(&output) == 0)
+				interactive_eof = 1;
+			for(;;) {
+
+				buf = queue_read_pos(&output, &sz);
+				if (!buf)
+					break;
+				sz = write(STDOUT_FILENO, buf, sz);
+				if (sz <= 0)
+					break;
+				queue_advance_read(&output, sz);
+			}
+			if (interactive_eof)
+				goto out;
+		}
+	}
+	retval = -1;
+
+out:
+	queue_destroy(&input);
+	queue_destroy(&output);
+	return retval;
+}
+
+void shrun_options_init(struct shrun_options *options)
+{
+	memset(options, 0, sizeof(*options));
+	options->shell = "/bin/sh";
+	options->timeout = 5;
+	options->stop_at = (unsigned int)-1;
+	options->memory_limit = 64 << 20;
+}
+
+struct shrun_session *shrun_session_new(const struct shrun_options *options,
+					int script_fd,
+					const struct shrun_callbacks *callbacks,
+					void *priv)
+{
+	struct shrun_session *session;
+	struct queue *queues[9];
+	int n;
+
+	session = calloc(1, sizeof(*session));
+	if (!session)
+		return NULL;
+	session->options = *options;
+	session->callbacks = callbacks;
+	session->priv = priv;
+	session->script_fd = script_fd;
+	session->in = session->out = session->control_fd = -1;
+	session->stdin_path = session->stdin_fd = -1;
+	session->channel_file = session->channel_fd = -1;
+	session->pid = -1;
+	session->veof = '\4';
+	session->first_lineno = session->lineno = 1;
+	session->reading_testcase = 1;
+	session->trace_commands = TRACE_THREAD(sessions, TRACE_COMMANDS);
+	session->trace_spans = TRACE_THREAD(sessions, TRACE_SPANS);
+	sessions++;
+	counters_init(&session->counters);
+
+	queues[0] = &session->script;
+	queues[1] = &session->control;
+	queues[2] = &session->testcase;
+	queues[3] = &session->expected;
+	queues[4] = &session->input;
+	queues[5] = &session->output;
+	queues[6] = &session->command;
+	queues[7] = &session->bench_cmd;
+	queues[8] = &session->setup;
+	for (n = 0; n < 9; n++) {
+		queue_init(queues[n]);
+		queue_set_limit(queues[n], options->memory_limit);
+	}
+	return session;
+}
+
+/*
+  Create a fifo and return an O_PATH file descriptor for it. The fifo is
+  removed again right away; it can still be opened through /proc.
+*/
+static int stdin_fifo(void)
+{
+	const char *tmpdir = getenv("TMPDIR");
+	char *dir, *path;
+	int fd = -1;
+
+	if (!tmpdir || !*tmpdir)
+		tmpdir = "/tmp";
+	dir = malloc(strlen(tmpdir) + 14);
+	path = malloc(strlen(tmpdir) + 20);
+	if (!dir || !path)
+		goto out;
+	sprintf(dir, "%s/shrun.XXXXXX", tmpdir);
+	if (!mkdtemp(dir))
+		goto out;
+	sprintf(path, "%s/stdin", dir);
+	if (mkfifo(path, 0600) == 0) {
+		fd = open(path, O_PATH | O_CLOEXEC);
+		unlink(path);
+	}
+	rmdir(dir);
+
+out:
+	free(dir);
+	free(path);
+	return fd;
+}
+
+/* Tell the shell to run the commands in the channel file. */
+static int run_channel(struct shrun_session *session)
+{
+	ssize_t sz;
+
+	sz = write(session->channel_fd, "\n", 1);
+	stats.writes[STATS_SHELL]++;
+	if (sz != 1)
+		return -1;
+	stats.write_bytes[STATS_SHELL] += 1;
+	return 0;
+}
+
+/*
+  Move the command from the testcase into the channel file, and run it.
+  Only the input is then left to write to the terminal.
+*/
+static int send_channel(struct shrun_session *session)
+{
+	struct queue *testcase = &session->testcase;
+	char *buf;
+	ssize_t sz;
+
+	buf = queue_read_pos(testcase, &sz);
+	if (ftruncate(session->channel_file, 0) != 0 ||
+	    pwrite(session->channel_file, buf, sz, 0) != sz)
+		return -1;
+	stats.writes[STATS_SHELL]++;
+	stats.write_bytes[STATS_SHELL] += sz;
+	queue_reset(testcase);
+	session->preamble = 0;
+	return run_channel(session);
+}
+
+/* Should the input of the current command go through the fifo? */
+static int use_stdin_fifo(struct shrun_session *session)
+{
+	const unsigned char *buf, *line;
+	ssize_t sz, n;
+
+	if (session->stdin_path == -1)
+		return 0;
+	if (session->options.stdin_mode == SHRUN_STDIN_FIFO)
+		return 1;
+	buf = (unsigned char *)queue_read_pos(&session->input, &sz);
+	if (sz > PTY_INPUT_MAX)
+		return 1;
+	for (line = buf, n = 0; n < sz; n++) {
+		if (buf[n] == '\n') {
+			if (buf + n - line > PTY_LINE_MAX)
+				return 1;
+			line = buf + n + 1;
+		} else if ((buf[n] < ' ' && buf[n] != '\t') || buf[n] == 0x7f)
+			return 1;
+	}
+	return 0;
+}
+
+static void close_stdin(struct shrun_session *session)
+{
+	if (session->stdin_fd != -1) {
+		close(session->stdin_fd);
+		session->stdin_fd = -1;
+	}
+}
+
+/*
+  Open the fifo for writing the input of the current command to. The
+  fifo is opened for reading as well so that this does not block, and so
+  that the data written is kept until the shell has opened the fifo.
+*/
+static int open_stdin(struct shrun_session *session)
+{
+	char path[32];
+
+	close_stdin(session);
+	sprintf(path, "/proc/self/fd/%d", session->stdin_path);
+	session->stdin_fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (session->stdin_fd == -1)
+		return -1;
+	session->stdin_pos = 0;
+	session->stdin_opened = 0;
+	return 0;
+}
+
+/*
+  Close the fifo once the shell has it open and all the input is written,
+  so that the command sees the end of its input.
+*/
+static void check_stdin(struct shrun_session *session)
+{
+	if (session->stdin_fd != -1 && session->stdin_opened &&
+	    session->stdin_pos == queue_length(&session->input))
+		close_stdin(session);
+}
+
+/* Wrap the command in the testcase so that it reads from the fifo. */
+static int wrap_stdin(struct shrun_session *session)
+{
+	struct queue *testcase = &session->testcase;
+	char *buf;
+	ssize_t sz;
+
+	queue_erase_tail(testcase, queue_length(testcase) - session->preamble);
+	if (queue_append(testcase, stdin_begin_cmd) != 0)
+		return -1;
+	buf = queue_read_pos(&session->command, &sz);
+	if (!queue_write_pos(testcase, sz, NULL))
+		return -1;
+	memcpy(testcase->write, buf, sz);
+	queue_advance_write(testcase, sz);
+	if (queue_append(testcase, stdin_end_cmd) != 0)
+		return -1;
+	session->stdin_fifo = 1;
+	return open_stdin(session);
+}
+
+static void close_pipe(int *pipe, int end)
+{
+	if (pipe[end] != -1) {
+		close(pipe[end]);
+		pipe[end] = -1;
+	}
+}
+
+/* Pass a close-on-exec file descriptor on to the shell as number to. */
+static void inherit_fd(int fd, int to)
+{
+	if (fd == to)
+		fcntl(fd, F_SETFD, 0);
+	else if (fd != -1)
+		dup2(fd, to);
+}
+
+/*
+  Start a shell on a new terminal. With counters, the child waits until
+  they are attached, so that all its children inherit them.
+*/
+static int spawn_shell(struct shrun_session *session)
+{
+	int ptm = -1, output[2] = { -1, -1 }, control[2] = { -1, -1 },
+	    channel[2] = { -1, -1 }, sync[2] = { -1, -1 }, error;
+	pid_t pid = -1;
+
+	if ((session->channel_file != -1 && pipe2(channel, O_CLOEXEC) != 0) ||
+	    pipe(output) != 0 || pipe(control) != 0 ||
+	    (session->options.counters && pipe2(sync, O_CLOEXEC) != 0))
+		goto fail;
+	session->channel_fd = channel[PIPE_WRITE];
+
+	pid = pty_fork(&ptm);
+	if (pid < 0)
+		goto fail;
+
+	if (pid == 0) {
+		const char *shell = session->options.shell;
+
+		if (sync[PIPE_READ] != -1) {
+			char c;
+
+			close(sync[PIPE_WRITE]);
+			while (read(sync[PIPE_READ], &c, 1) < 0 &&
+			       errno == EINTR)
+				;
+			close(sync[PIPE_READ]);
+		}
+
+		close(output[PIPE_READ]);
+		if (output[PIPE_WRITE] != STDOUT_FILENO) {
+			dup2(output[PIPE_WRITE], STDOUT_FILENO);
+			close(output[PIPE_WRITE]);
+		}
+		close(control[PIPE_READ]);
+		if (control[PIPE_WRITE] != 109) {
+			dup2(control[PIPE_WRITE], 109);
+			close(control[PIPE_WRITE]);
+		}
+		inherit_fd(session->stdin_path, 108);
+		if (session->channel_fd != -1) {
+			inherit_fd(session->channel_file, 106);
+			inherit_fd(channel[PIPE_READ], 107);
+		}
+		if (!session->options.no_stderr)
+			dup2(STDOUT_FILENO, STDERR_FILENO);
+
+		if (session->options.env) {
+			const char *const *env;
+
+			for (env = session->options.env; *env; env++)
+				putenv((char *)*env);
+		}
+		if (session->options.isolate && isolate() != 0) {
+			fprintf(stderr, "%s: cannot isolate: %s\n",
+				program_invocation_short_name,
+				strerror(errno));
+			exit(1);
+		}
+		if (session->channel_fd != -1)
+			execl(shell, shell, "-c", channel_loop, NULL);
+		else
+			execl(shell, shell, NULL);
+		fprintf(stderr, "%s: %s: %s\n",
+			program_invocation_short_name, shell, strerror(errno));
+		exit(1);
+	}
+
+	close_pipe(output, PIPE_WRITE);
+	close_pipe(control, PIPE_WRITE);
+	close_pipe(channel, PIPE_READ);
+	if (sync[PIPE_READ] != -1) {
+		if (counters_open(&session->counters,
+				  session->options.counters, pid) != 0)
+			goto fail;
+		close_pipe(sync, PIPE_READ);
+		close_pipe(sync, PIPE_WRITE);
+	}
+	session->pid = pid;
+	session->in = output[PIPE_READ];
+	session->out = ptm;
+	session->control_fd = control[PIPE_READ];
+
+	if (isatty(ptm)) {
+		struct termios term;
+		char name[64];
+		struct stat st;
+
+		if (tcgetattr(ptm, &term) < 0)
+			return -1;
+
+		/* Turn off terminal echo. */
+		term.c_lflag &= ~(ECHO | ECHOE | ECHOK | ECHONL);
+
+		/* Turn off '\n' to '\r\n' translation. */
+		term.c_oflag &= ~(ONLCR);
+
+		if (tcsetattr(ptm, TCSANOW, &term) < 0)
+			return -1;
+		session->veof = term.c_cc[VEOF];
+
+		if (ptsname_r(ptm, name, sizeof(name)) == 0 &&
+		    stat(name, &st) == 0)
+			session->tty = st.st_rdev;
+	}
+	return 0;
+
+fail:
+	error = errno;
+	if (pid > 0) {
+		/* The shell is waiting for the counters. */
+		kill(pid, SIGKILL);
+		while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+			;
+		close(ptm);
+	}
+	close_pipe(output, PIPE_READ);
+	close_pipe(output, PIPE_WRITE);
+	close_pipe(control, PIPE_READ);
+	close_pipe(control, PIPE_WRITE);
+	close_pipe(channel, PIPE_READ);
+	close_pipe(channel, PIPE_WRITE);
+	close_pipe(sync, PIPE_READ);
+	close_pipe(sync, PIPE_WRITE);
+	session->channel_fd = -1;
+	errno = error;
+	return -1;
+}
+
+/*
+  The shell process. With --isolate, it is the child of the init process
+  of the new PID namespace, which is our child.
+*/
+static pid_t shell_pid(struct shrun_session *session)
+{
+	if (!session->shell) {
+		session->shell = session->pid;
+		if (session->options.isolate)
+			session->shell = first_child(first_child(session->pid));
+	}
+	return session->shell;
+}
+
+/*
+  Wait for the shell, which is expected to exit. If it does not exit
+  within REAP_WAIT, it is killed. Returns the wait status, or -1 when it
+  is unknown (as when SIGCHLD is ignored).
+*/
+static int reap_shell(struct shrun_session *session, int *killed)
+{
+	double deadline = now() + REAP_WAIT;
+	struct timespec ts = { 0, 1000000 };
+	int status;
+	pid_t pid;
+
+	*killed = 0;
+	if (session->pid == -1)
+		return -1;
+	for (;;) {
+		pid = waitpid(session->pid, &status, WNOHANG);
+		if (pid != 0 || now() >= deadline)
+			break;
+		nanosleep(&ts, NULL);
+	}
+	if (pid == 0) {
+		kill(session->pid, SIGKILL);
+		*killed = 1;
+		do
+			pid = waitpid(session->pid, &status, 0);
+		while (pid < 0 && errno == EINTR);
+	}
+	session->pid = -1;
+	session->shell = 0;
+	return pid > 0 ? status : -1;
+}
+
+/*
+  The shell is gone: close its terminal and pipes. The preamble for the
+  next shell defines the special commands again, and replays the commands
+  marked as setup with their input and output discarded. The next shell
+  is only started once there is a command for it to run.
+*/
+static int replace_shell(struct shrun_session *session)
+{
+	struct queue *testcase = &session->testcase;
+	char *buf;
+	ssize_t sz;
+
+	close(session->in);
+	close(session->out);
+	session->in = session->out = -1;
+	if (session->control_fd != -1) {
+		close(session->control_fd);
+		session->control_fd = -1;
+	}
+	if (session->channel_fd != -1) {
+		close(session->channel_fd);
+		session->channel_fd = -1;
+	}
+	queue_reset(&session->control);
+	counters_close(&session->counters);
+	session->in_eof = 0;
+	session->marker_pending = 0;
+	session->tty = 0;
+
+	queue_reset(testcase);
+	if (queue_append(testcase, control_cmds) != 0)
+		return -1;
+	buf = queue_read_pos(&session->setup, &sz);
+	if (buf) {
+		if (queue_append(testcase, "{\n") != 0 ||
+		    !queue_write_pos(testcase, sz, NULL))
+			return -1;
+		memcpy(testcase->write, buf, sz);
+		queue_advance_write(testcase, sz);
+		if (queue_append(testcase,
+				 "} </dev/null >/dev/null 2>&1\n") != 0)
+			return -1;
+	}
+	session->preamble = queue_length(testcase);
+	return 0;
+}
+
+static void finish(struct shrun_session *session, enum shrun_end end)
+{
+	struct shrun_summary summary;
+
+	if (session->done)
+		return;
+	session->done = 1;
+	session->end = end;
+	if (end == SHRUN_ERROR)
+		session->error = errno;
+	else if (end != SHRUN_DONE)
+		session->failed++;
+	summary.passed = session->passed;
+	summary.failed = session->failed;
+	summary.end = end;
+	summary.error = session->error;
+	if (session->callbacks->end) {
+		double start = now();
+
+		session->callbacks->end(session->priv, &summary);
+		stats.report_time += now() - start;
+	}
+}
+
+static void fill_command(struct shrun_session *session,
+			 struct shrun_command *command)
+{
+	ssize_t sz;
+
+	memset(command, 0, sizeof(*command));
+	command->lineno = session->first_lineno;
+	command->command = queue_read_pos(&session->command, &sz);
+	command->command_len = sz;
+	command->output = queue_read_pos(&session->output, &sz);
+	command->output_len = sz;
+	command->expected = queue_read_pos(&session->expected, &sz);
+	command->expected_len = sz;
+}
+
+static void update_script(struct shrun_session *session)
+{
+	struct shrun_lines *lines = &session->output_lines;
+	FILE *ufp = session->options.update;
+	const char *buf;
+	size_t n;
+
+	buf = queue_read_pos(&session->output, NULL);
+	for (n = 0; n < lines->n; n++) {
+		size_t len = lines->start[n + 1] - lines->start[n];
+		const char *l = buf + lines->start[n];
+
+		if (session->testcase_indent)
+			fputs(session->testcase_indent, ufp);
+		fprintf(ufp, "> %.*s", (int)len, l);
+		if (l[len - 1] != '\n')
+			fputs("\n", ufp);
+	}
+}
+
+/* How a session ends when recovering from status fails. */
+static enum shrun_end recover_end(enum shrun_status status)
+{
+	switch(status) {
+	case SHRUN_TIMEOUT:
+		return SHRUN_TIMED_OUT;
+	case SHRUN_OUTPUT_LIMIT:
+		return SHRUN_OUTPUT_EXCEEDED;
+	default:
+		return SHRUN_INPUT_WAIT;
+	}
+}
+
+/*
+  Get rid of a command which has timed out, is waiting for input, or has
+  exceeded the output limit, so that the script can go on with the next
+  command. With job control (as
+  in interactive shells), the command runs in the terminal's foreground
+  process group; otherwise, all the shell's descendants are killed. A
+  stopped shell is continued; a shell busy running a builtin cannot be
+  interrupted without killing it.
+
+  Whatever is left of the command and its input in the terminal is
+  discarded. With the pty channel, a new end marker follows once the
+  killed processes are gone (or after a second), so that they cannot read
+  it. If the shell does not come back with it in time, it is killed as
+  well, and a new shell takes over. Only if even that does not end its
+  output does the session end.
+*/
+static void recover(struct shrun_session *session, enum shrun_status status)
+{
+	pid_t shell = shell_pid(session), pgrp;
+	char name[64];
+	int fd;
+
+	if (session->recovering) {
+		if (!session->shell_killed && shell > 0) {
+			trace_instant(session->trace_commands, "kill shell",
+				      now());
+			kill(shell, SIGKILL);
+			session->shell_killed = 1;
+			session->marker_pending = 0;
+			session->last_activity = now();
+			return;
+		}
+		finish(session, recover_end(session->recovering));
+		return;
+	}
+	trace_instant(session->trace_commands, "recover", now());
+	if (shell <= 0) {
+		finish(session, recover_end(status));
+		return;
+	}
+	/* Flushing the input queue only works from the terminal's side. */
+	if (ptsname_r(session->out, name, sizeof(name)) == 0) {
+		fd = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+		if (fd != -1) {
+			tcflush(fd, TCIFLUSH);
+			close(fd);
+		}
+	}
+	queue_reset(&session->testcase);
+	close_stdin(session);
+
+	pgrp = tcgetpgrp(session->out);
+	if (pgrp <= 0 || pgrp == getpgid(shell))
+		pgrp = 0;
+	session->nkilled = kill_descendants(shell, pgrp, SIGKILL,
+					    session->killed, KILLED_MAX);
+	if (session->nkilled > KILLED_MAX)
+		session->nkilled = KILLED_MAX;
+	kill(shell, SIGCONT);
+
+	session->marker_pending = (session->channel_fd == -1);
+	session->recover_start = now();
+	session->recovering = status;
+	session->recover_output = queue_length(&session->output);
+	session->bench_runs = session->bench_run = 0;
+	session->last_activity = now();
+}
+
+/* Start over looking for commands waiting for input. */
+static void watch_input(struct shrun_session *session)
+{
+	session->reader = 0;
+	session->probe_interval = INPUT_WAIT_MIN;
+	session->probe_at = now() + INPUT_WAIT_MIN;
+}
+
+/*
+  Is a command running which might wait for input from the terminal? The
+  command and its input must be written out completely.
+*/
+static int probing(struct shrun_session *session)
+{
+	return session->options.input_wait != SHRUN_INPUT_WAIT_TIMEOUT &&
+	       session->tty && !session->paused && !session->marker_pending &&
+	       !session->shell_killed &&
+	       !session->reading_testcase && !session->testcase_eof &&
+	       !session->in_eof && queue_empty(&session->testcase);
+}
+
+/*
+  Check if a process is blocked reading from the terminal. Data written
+  to the pty may take a moment to reach the reader, so the same process
+  must still be blocked after INPUT_WAIT_MIN.
+
+  The command may already have read the end marker command as input (as
+  with "cat" when there is no input): it is sent again after the
+  end-of-file. A shell which waits for input itself has either lost the
+  end marker command in this way (and then only needs it again), or is
+  running a builtin like "read".
+*/
+static void probe_input(struct shrun_session *session)
+{
+	pid_t reader;
+
+	reader = tty_reader(session->out, session->tty, shell_pid(session));
+	if (!reader) {
+		session->reader = 0;
+		session->probe_interval = session->probe_interval * 2;
+		if (session->probe_interval > INPUT_WAIT_MAX)
+			session->probe_interval = INPUT_WAIT_MAX;
+		session->probe_at = now() + session->probe_interval;
+		return;
+	}
+	if (reader != session->reader) {
+		session->reader = reader;
+		session->probe_at = now() + INPUT_WAIT_MIN;
+		return;
+	}
+	trace_instant(session->trace_commands, "waiting for input", now());
+	if (session->options.input_wait == SHRUN_INPUT_WAIT_EOF &&
+	    !session->eof_sent) {
+		session->eof_sent = 1;
+		if ((reader != shell_pid(session) ||
+		     session->channel_fd != -1) &&
+		    queue_write_pos(&session->testcase, 1, NULL)) {
+			*session->testcase.write = session->veof;
+			queue_advance_write(&session->testcase, 1);
+		}
+		if (session->channel_fd == -1)
+			queue_append(&session->testcase, end_marker_cmd);
+		watch_input(session);
+		return;
+	}
+	recover(session, SHRUN_WAITING);
+}
+
+/*
+  Take the result of the command just read from the recording, as if the
+  shell had produced it. Returns 0 when the recording ends.
+*/
+static int replay(struct shrun_session *session)
+{
+	struct shrun_command *command = &session->replayed;
+	char *buf;
+	int retval;
+
+	fill_command(session, command);
+	command->exit_status = -1;
+	retval = session->options.replay(session->options.replay_priv,
+					 command);
+	if (retval <= 0)
+		return retval;
+	if (command->output_len) {
+		buf = queue_write_pos(&session->output, command->output_len,
+				      NULL);
+		if (!buf)
+			return -1;
+		memcpy(buf, command->output, command->output_len);
+		queue_advance_write(&session->output, command->output_len);
+	}
+	queue_reset(&session->testcase);
+	session->reading_testcase = 0;
+	session->testcase_eof = 1;
+	return 1;
+}
+
+/*
+  Move on as far as possible without waiting for any file descriptors.
+*/
+static void advance(struct shrun_session *session)
+{
+	struct queue *testcase = &session->testcase,
+		     *output = &session->output;
+	int retval;
+
+again:
+	if (session->paused)
+		return;
+	if (!session->reading_testcase && session->testcase_eof &&
+	    session->bench_runs) {
+		session->bench_times[session->bench_run++] =
+			session->run_end - session->bench_start;
+		if (session->bench_run == 1 && session->bench_changed) {
+			/*
+			  The command changed the benchmark settings
+			  itself (as in "bench 10" followed by
+			  "budget ..."): keep the settings for the
+			  next command instead of applying them here.
+			*/
+			if (!session->bench_next && session->bench_runs > 1)
+				session->bench_next = session->bench_runs;
+			if (!session->budget_next)
+				session->budget_next = session->bench_budget;
+			else
+				free(session->bench_budget);
+			session->bench_budget = NULL;
+			session->bench_runs = session->bench_run = 0;
+		} else if (session->bench_run == 1)
+			session->bench_output = queue_length(output);
+		else
+			queue_erase_tail(output, queue_length(output) -
+						 session->bench_output);
+		if (session->bench_runs &&
+		    session->bench_run < session->bench_runs) {
+			/* Run the command again; only the output of the
+			   first run is checked. */
+			char *buf1, *buf2;
+			ssize_t sz;
+
+			buf1 = queue_read_pos(&session->bench_cmd, &sz);
+			if (buf1) {
+				buf2 = queue_write_pos(testcase, sz, NULL);
+				if (!buf2)
+					goto fail;
+				memcpy(buf2, buf1, sz);
+				queue_advance_write(testcase, sz);
+			}
+			if (session->stdin_fifo && open_stdin(session) != 0)
+				goto fail;
+			if (session->channel_fd != -1 &&
+			    run_channel(session) != 0)
+				goto fail;
+			session->testcase_eof = 0;
+			session->bench_start = now();
+			session->eof_sent = 0;
+			watch_input(session);
+		}
+	}
+	if (!session->reading_testcase &&
+	    (session->testcase_eof || session->in_eof) &&
+	    (!session->bench_runs || session->bench_run == session->bench_runs ||
+	     session->in_eof)) {
+		struct shrun_command command;
+		struct shrun_bench bench;
+		int exit_status = -1, killed = 0;
+
+		trace_end(session->trace_commands, now());
+		if (session->in_eof)
+			exit_status = reap_shell(session, &killed);
+		if (session->recovering)
+			queue_erase_tail(output, queue_length(output) -
+						 session->recover_output);
+		fill_command(session, &command);
+		command.exit_status = -1;
+		if (session->options.counters) {
+			counters_stop(&session->counters, &session->counts);
+			command.counters = &session->counts;
+		}
+		if (session->recovering)
+			command.status = session->recovering;
+		else if (session->options.replay &&
+			 session->replayed.status != SHRUN_OK &&
+			 session->replayed.status != SHRUN_FAILED) {
+			command.status = session->replayed.status;
+			command.exit_status = session->replayed.exit_status;
+		} else if (!session->testcase_eof && killed)
+			command.status = SHRUN_SHORT_RESULT;
+		else if (!session->testcase_eof) {
+			command.status = SHRUN_EXITED;
+			command.exit_status = exit_status;
+		} else if (command.output_len == command.expected_len &&
+			 (command.output_len == 0 ||
+			  memcmp(command.output, command.expected,
+				 command.output_len) == 0))
+			command.status = SHRUN_OK;
+		else
+			command.status = SHRUN_FAILED;
+		command.passed = (command.status == SHRUN_OK);
+		if (command.status == SHRUN_FAILED || session->options.update) {
+			if (shrun_lines_index(&session->output_lines,
+					      command.output,
+					      command.output_len) != 0)
+				goto fail;
+			command.output_lines = &session->output_lines;
+		}
+		if (command.status == SHRUN_FAILED) {
+			if (shrun_lines_index(&session->expected_lines,
+					      command.expected,
+					      command.expected_len) != 0)
+				goto fail;
+			command.expected_lines = &session->expected_lines;
+		}
+		command.duration = now() - session->command_start;
+		if (session->options.replay)
+			command.duration = session->replayed.duration;
+		if (session->bench_run) {
+			bench_stats(session->bench_times, session->bench_run,
+				    session->bench_budget, &bench);
+			command.bench = &bench;
+			if (bench.budget_exceeded)
+				command.passed = 0;
+		}
+		if (session->callbacks->result) {
+			double start = now();
+
+			session->callbacks->result(session->priv, &command);
+			stats.report_time += now() - start;
+		}
+		if (command.passed)
+			session->passed++;
+		else
+			session->failed++;
+		if (session->options.update)
+			update_script(session);
+		if (session->setup_cmd && command.status == SHRUN_OK) {
+			if (!queue_write_pos(&session->setup,
+					     command.command_len, NULL))
+				goto fail;
+			memcpy(session->setup.write, command.command,
+			       command.command_len);
+			queue_advance_write(&session->setup,
+					    command.command_len);
+		}
+		session->setup_cmd = 0;
+		close_stdin(session);
+		session->stdin_fifo = 0;
+		queue_reset(&session->expected);
+		queue_reset(&session->input);
+		queue_reset(output);
+		queue_reset(&session->command);
+		queue_reset(&session->bench_cmd);
+		free(session->bench_budget);
+		session->bench_budget = NULL;
+		session->bench_runs = session->bench_run = 0;
+		session->recovering = 0;
+		session->shell_killed = 0;
+		session->reading_testcase = 1;
+		session->preamble = 0;
+		session->parse_start = now();
+		if (session->pid == -1 && !session->options.replay &&
+		    replace_shell(session) != 0)
+			goto fail;
+	}
+	if (session->reading_testcase) {
+		if (session->script_eof && queue_empty(&session->script) &&
+		    queue_length(testcase) == session->preamble) {
+			finish(session, SHRUN_DONE);
+			return;
+		}
+
+		retval = read_testcase(session, session->script_eof);
+		if (retval < 0)
+			goto fail;
+		if (retval > 0) {
+			size_t preamble = session->preamble;
+			struct shrun_command command;
+			char *buf, *newline;
+			ssize_t sz;
+			double t = now();
+
+			session->command_start = t;
+			if (session->pid == -1 && !session->options.replay &&
+			    spawn_shell(session) != 0)
+				goto fail;
+			session->setup_cmd = session->setup_next;
+			session->setup_next = 0;
+			if (session->options.counters)
+				counters_start(&session->counters);
+			buf = queue_read_pos(testcase, &sz);
+			if (queue_write_pos(&session->command, sz - preamble,
+					    NULL) == NULL)
+				goto fail;
+			memcpy(session->command.write, buf + preamble,
+			       sz - preamble);
+			queue_advance_write(&session->command, sz - preamble);
+			fill_command(session, &command);
+			if (session->callbacks->begin)
+				session->callbacks->begin(session->priv,
+							  &command);
+
+			newline = memchr(buf + preamble, '\n', sz - preamble);
+			trace_complete(session->trace_commands, "parse",
+				       session->parse_start, t);
+			trace_begin(session->trace_commands, buf + preamble,
+				    newline ? newline - buf - preamble :
+					      sz - preamble,
+				    session->first_lineno, t);
+
+			if (session->options.replay) {
+				retval = replay(session);
+				if (retval < 0)
+					goto fail;
+				if (retval == 0) {
+					finish(session, SHRUN_INTERRUPTED);
+					return;
+				}
+				goto again;
+			}
+			if (!queue_empty(&session->input) &&
+			    use_stdin_fifo(session) &&
+			    wrap_stdin(session) != 0)
+				goto fail;
+			if (session->channel_fd != -1) {
+				if (send_channel(session) != 0)
+					goto fail;
+				preamble = 0;
+			}
+			if (!queue_empty(&session->input) &&
+			    !session->stdin_fifo) {
+				char *buf1, *buf2;
+
+				buf1 = queue_read_pos(&session->input, &sz);
+				buf2 = queue_write_pos(testcase, sz + 1, NULL);
+				if (!buf2)
+					goto fail;
+				memcpy(buf2, buf1, sz);
+				buf2[sz] = session->veof;
+				queue_advance_read(&session->input, sz);
+				queue_advance_write(testcase, sz + 1);
+			}
+			if (session->channel_fd == -1 &&
+			    queue_append(testcase, end_marker_cmd) != 0)
+				goto fail;
+			if (session->bench_next || session->budget_next ||
+			    session->options.bench) {
+				session->bench_runs = session->bench_next ?
+					session->bench_next :
+					max(session->options.bench, 1);
+				session->bench_budget = session->budget_next;
+				session->bench_next = 0;
+				session->budget_next = NULL;
+				session->bench_changed = 0;
+				session->bench_times = realloc(session->bench_times,
+					session->bench_runs *
+					sizeof(*session->bench_times));
+				if (!session->bench_times)
+					goto fail;
+				/* With the file channel, only the input may
+				   be left to pass through the terminal. */
+				buf = queue_read_pos(testcase, &sz);
+				if (sz > preamble) {
+					if (queue_write_pos(&session->bench_cmd,
+							    sz - preamble,
+							    NULL) == NULL)
+						goto fail;
+					memcpy(session->bench_cmd.write,
+					       buf + preamble, sz - preamble);
+					queue_advance_write(&session->bench_cmd,
+							    sz - preamble);
+				}
+			}
+			session->reading_testcase = 0;
+			session->testcase_eof = 0;
+			session->bench_start = now();
+			session->last_activity = now();
+			session->eof_sent = 0;
+			watch_input(session);
+		}
+	}
+	if (session->options.stop_at <= session->first_lineno) {
+		if (session->pid == -1 && spawn_shell(session) != 0)
+			goto fail;
+		if (session->callbacks->interactive)
+			session->callbacks->interactive(session->priv);
+		if (interactive(session->in, session->out) < 0)
+			goto fail;
+		session->options.stop_at = (unsigned int)-1;
+		session->last_activity = now();
+	}
+	return;
+
+fail:
+	finish(session, SHRUN_ERROR);
+}
+
+int shrun_session_start(struct shrun_session *session)
+{
+	if (session->options.replay) {
+		session->parse_start = session->last_activity = now();
+		advance(session);
+		return 0;
+	}
+	if (session->options.stdin_mode != SHRUN_STDIN_PTY) {
+		session->stdin_path = stdin_fifo();
+		if (session->stdin_path == -1 &&
+		    session->options.stdin_mode == SHRUN_STDIN_FIFO)
+			return -1;
+	}
+	if (session->options.channel == SHRUN_CHANNEL_FILE &&
+	    session->options.stop_at == (unsigned int)-1) {
+		session->channel_file = memfd_create("shrun", MFD_CLOEXEC);
+		if (session->channel_file == -1)
+			return -1;
+	}
+	if (spawn_shell(session) != 0)
+		return -1;
+
+	if (queue_append(&session->testcase, control_cmds) != 0)
+		return -1;
+	session->preamble = queue_length(&session->testcase);
+	session->parse_start = session->last_activity = now();
+	session->paused = session->options.pace;
+	advance(session);
+	return 0;
+}
+
+static int add_pollfd(struct pollfd *fds, int nfds, int fd, short events)
+{
+	int n;
+
+	for (n = 0; n < nfds; n++) {
+		if (fds[n].fd == fd) {
+			fds[n].events |= events;
+			return nfds;
+		}
+	}
+	fds[nfds].fd = fd;
+	fds[nfds].events = events;
+	fds[nfds].revents = 0;
+	return nfds + 1;
+}
+
+/*
+  Fill in the file descriptors to poll (at most SHRUN_POLLFDS), and the
+  poll timeout in milliseconds (-1 for none). Returns the number of file
+  descriptors, or -1 when the session is done.
+*/
+int shrun_session_pollfds(struct shrun_session *session, struct pollfd *fds,
+			  int *timeout)
+{
+	int nfds = 0;
+
+	*timeout = -1;
+	if (session->done)
+		return -1;
+	if (session->reading_testcase) {
+		if (!session->script_eof)
+			nfds = add_pollfd(fds, nfds, session->script_fd,
+					  POLLIN);
+	} else {
+		if (!session->in_eof)
+			nfds = add_pollfd(fds, nfds, session->in, POLLIN);
+		if (!queue_empty(&session->testcase))
+			nfds = add_pollfd(fds, nfds, session->out, POLLOUT);
+		if (session->stdin_fd != -1 &&
+		    session->stdin_pos < queue_length(&session->input))
+			nfds = add_pollfd(fds, nfds, session->stdin_fd,
+					  POLLOUT);
+		if (session->options.timeout && !session->paused) {
+			double left = session->last_activity +
+				      session->options.timeout - now();
+
+			*timeout = left > 0 ? ceil(left * 1e3) : 0;
+		}
+		if (session->marker_pending)
+			*timeout = 1;
+		else if (probing(session)) {
+			double left = session->probe_at - now();
+			int t = left > 0 ? ceil(left * 1e3) : 0;
+
+			if (*timeout < 0 || t < *timeout)
+				*timeout = t;
+		}
+		if (session->in_eof)
+			*timeout = 0;
+	}
+	if (session->control_fd != -1)
+		nfds = add_pollfd(fds, nfds, session->control_fd, POLLIN);
+	if ((nfds == 0 && !session->paused) || session->resumed)
+		*timeout = 0;
+	return nfds;
+}
+
+static short revents(const struct pollfd *fds, int nfds, int fd, short events)
+{
+	int n;
+
+	if (fd == -1)
+		return 0;
+	for (n = 0; n < nfds; n++) {
+		if (fds[n].fd == fd)
+			return fds[n].revents &
+			       (events | POLLHUP | POLLERR | POLLNVAL);
+	}
+	return 0;
+}
+
+static int read_control(struct shrun_session *session)
+{
+	struct queue *control = &session->control;
+	char *buf, *newline;
+	ssize_t sz;
+
+	buf = queue_write_pos(control, 256, &sz);
+	if (!buf)
+		return -1;
+	sz = read(session->control_fd, buf, sz);
+	stats.reads[STATS_CONTROL]++;
+	if (sz > 0)
+		stats.read_bytes[STATS_CONTROL] += sz;
+	if (sz == 0) {
+		close(session->control_fd);
+		session->control_fd = -1;
+		return 0;
+	} else if (sz < 0)
+		return -1;
+
+	queue_advance_write(control, sz);
+	while ((buf = queue_read_pos(control, &sz)) &&
+	       (newline = memchr(buf, '\n', sz))) {
+		int stat;
+		double limit;
+
+		*newline = '\0';
+		if (strncmp(buf, "timeout ", 8) == 0)
+			session->options.timeout = atoi(buf + 8);
+		else if (strncmp(buf, "bench ", 6) == 0 &&
+			 atoi(buf + 6) > 0) {
+			session->bench_next = atoi(buf + 6);
+			session->bench_changed = 1;
+		} else if (strncmp(buf, "budget ", 7) == 0 &&
+			   parse_budget(buf + 7, &stat, &limit) == 0) {
+			free(session->budget_next);
+			session->budget_next = strdup(buf + 7);
+			session->bench_changed = 1;
+		} else if (strncmp(buf, "span begin ", 11) == 0)
+			trace_begin(session->trace_spans, buf + 11,
+				    strlen(buf + 11), 0, now());
+		else if (strcmp(buf, "span end") == 0)
+			trace_end(session->trace_spans, now());
+		else if (strcmp(buf, "setup") == 0)
+			session->setup_next = 1;
+		else if (strcmp(buf, "stdin") == 0) {
+			session->stdin_opened = 1;
+			check_stdin(session);
+		}
+		else {
+			finish(session, SHRUN_UNKNOWN_CONTROL);
+			return 0;
+		}
+		queue_advance_read(control, newline - buf + 1);
+	}
+	return 0;
+}
+
+/*
+  Do the work that the poll() results in fds allow. Returns 1 while the
+  session is running, and 0 when it is done.
+*/
+int shrun_session_step(struct shrun_session *session,
+		       const struct pollfd *fds, int nfds)
+{
+	short out_ready;
+
+	if (session->done)
+		return 0;
+	stats.wakeups++;
+	session->resumed = 0;
+
+	if (!revents(fds, nfds, session->script_fd, POLLIN) &&
+	    !revents(fds, nfds, session->in, POLLIN) &&
+	    !revents(fds, nfds, session->out, POLLOUT) &&
+	    !revents(fds, nfds, session->stdin_fd, POLLOUT) &&
+	    !revents(fds, nfds, session->control_fd, POLLIN)) {
+		if (!session->reading_testcase && !session->in_eof &&
+		    !session->paused && session->options.timeout &&
+		    now() >= session->last_activity +
+			     session->options.timeout) {
+			recover(session, SHRUN_TIMEOUT);
+			if (session->done)
+				return 0;
+		}
+	} else {
+		session->last_activity = now();
+		watch_input(session);
+	}
+
+	if (session->reading_testcase &&
+	    revents(fds, nfds, session->script_fd, POLLIN)) {
+		char *buf;
+		ssize_t sz;
+
+		buf = queue_write_pos(&session->script, SCRIPT_READ, &sz);
+		if (!buf)
+			goto fail;
+		sz = read(session->script_fd, buf, sz);
+		stats.reads[STATS_SCRIPT]++;
+		if (sz < 0)
+			goto fail;
+		stats.read_bytes[STATS_SCRIPT] += sz;
+		queue_advance_write(&session->script, sz);
+		if (sz == 0)
+			session->script_eof = 1;
+	}
+	if (!session->reading_testcase &&
+	    revents(fds, nfds, session->stdin_fd, POLLOUT)) {
+		char *buf;
+		ssize_t sz;
+
+		buf = queue_read_pos(&session->input, &sz);
+		sz = write(session->stdin_fd, buf + session->stdin_pos,
+			   sz - session->stdin_pos);
+		stats.writes[STATS_STDIN]++;
+		if (sz < 0 && errno != EAGAIN)
+			goto fail;
+		if (sz > 0) {
+			stats.write_bytes[STATS_STDIN] += sz;
+			session->stdin_pos += sz;
+		}
+		check_stdin(session);
+	}
+	out_ready = !session->reading_testcase &&
+		    revents(fds, nfds, session->out, POLLOUT);
+	if (out_ready || (!session->reading_testcase && session->in_eof)) {
+		char *buf;
+		ssize_t sz;
+
+		buf = queue_read_pos(&session->testcase, &sz);
+		if (buf && !session->in_eof) {
+			if (!session->write_start)
+				session->write_start = now();
+			sz = write(session->out, buf, sz);
+			stats.writes[STATS_SHELL]++;
+			if (sz < 0)
+				goto fail;
+			stats.write_bytes[STATS_SHELL] += sz;
+		}
+		queue_advance_read(&session->testcase, sz);
+		if (session->write_start && queue_empty(&session->testcase)) {
+			trace_complete(session->trace_commands, "write",
+				       session->write_start, now());
+			session->write_start = 0;
+		}
+	}
+	if (!session->reading_testcase && !session->in_eof &&
+	    revents(fds, nfds, session->in, POLLIN)) {
+		struct queue *output = &session->output;
+		char *buf;
+		ssize_t sz;
+
+		buf = queue_write_pos(output, 256, &sz);
+		if (!buf)
+			goto fail;
+		sz = read(session->in, buf, sz);
+		stats.reads[STATS_SHELL]++;
+		if (sz == 0)
+			session->in_eof = 1;
+		else if (sz < 0)
+			goto fail;
+		else {
+			size_t before = queue_length(output);
+			double start;
+			int eof;
+
+			stats.read_bytes[STATS_SHELL] += sz;
+			queue_advance_write(output, sz);
+			start = now();
+			eof = (erase_end_marker(output) == 0);
+			stats.end_marker_time += now() - start;
+			if (queue_length(output) > before &&
+			    before == (session->bench_run ?
+				       session->bench_output : 0))
+				trace_instant(session->trace_commands,
+					      "first output", now());
+			if (eof) {
+				session->testcase_eof = 1;
+				session->run_end = now();
+				trace_instant(session->trace_commands,
+					      "end marker", session->run_end);
+				if (session->options.pace)
+					session->paused = 1;
+				if (session->callbacks->run)
+					session->callbacks->run(session->priv,
+						session->run_end -
+						session->bench_start);
+			}
+			/*
+			  Output beyond the limit even while recovering means
+			  that killing the command did not stop it.
+			*/
+			if (session->options.output_limit &&
+			    !session->testcase_eof &&
+			    queue_length(output) >
+			    (session->recovering ? session->recover_output : 0) +
+			    session->options.output_limit) {
+				recover(session, SHRUN_OUTPUT_LIMIT);
+				if (session->done)
+					return 0;
+			}
+		}
+	}
+	if (revents(fds, nfds, session->control_fd, POLLIN)) {
+		if (read_control(session) != 0)
+			goto fail;
+		if (session->done)
+			return 0;
+	}
+	if (session->marker_pending &&
+	    (processes_gone(session->killed, session->nkilled) ||
+	     now() >= session->recover_start + 1)) {
+		session->marker_pending = 0;
+		if (queue_append(&session->testcase, end_marker_cmd) != 0)
+			goto fail;
+		session->last_activity = now();
+	}
+	if (probing(session) && now() >= session->probe_at) {
+		probe_input(session);
+		if (session->done)
+			return 0;
+	}
+
+	advance(session);
+	return !session->done;
+
+fail:
+	finish(session, SHRUN_ERROR);
+	return 0;
+}
+
+/*
+  With pace set, a session pauses when it starts and after each run of a
+  command, and only goes on when resumed. This allows to run several
+  sessions in turns. Resuming takes effect in the next
+  shrun_session_step(), so it is safe from within callbacks.
+*/
+void shrun_session_resume(struct shrun_session *session)
+{
+	if (!session->paused)
+		return;
+	session->paused = 0;
+	session->resumed = 1;
+	session->last_activity = now();
+}
+
+void shrun_session_interrupt(struct shrun_session *session)
+{
+	finish(session, SHRUN_INTERRUPTED);
+}
+
+pid_t shrun_session_shell(struct shrun_session *session)
+{
+	if (session->pid == -1)
+		return -1;
+	return shell_pid(session);
+}
+
+/*
+  Returns the number of failed commands, or -1 if the session did not
+  run to the end.
+*/
+int shrun_session_result(struct shrun_session *session)
+{
+	if (!session->done || session->end != SHRUN_DONE)
+		return -1;
+	return session->failed;
+}
+
+static void stats_peak(int n, struct queue *queue)
+{
+	if (queue->peak > stats.peak[n])
+		stats.peak[n] = queue->peak;
+}
+
+void shrun_session_free(struct shrun_session *session)
+{
+	int killed;
+
+	if (!session)
+		return;
+	if (session->out != -1)
+		close(session->out);
+	if (session->in != -1)
+		close(session->in);
+	if (session->control_fd != -1)
+		close(session->control_fd);
+	close_stdin(session);
+	if (session->stdin_path != -1)
+		close(session->stdin_path);
+	if (session->channel_fd != -1)
+		close(session->channel_fd);
+	if (session->channel_file != -1)
+		close(session->channel_file);
+	reap_shell(session, &killed);
+	counters_close(&session->counters);
+	stats_peak(STATS_Q_SCRIPT, &session->script);
+	stats_peak(STATS_Q_CONTROL, &session->control);
+	stats_peak(STATS_Q_TESTCASE, &session->testcase);
+	stats_peak(STATS_Q_EXPECTED, &session->expected);
+	stats_peak(STATS_Q_INPUT, &session->input);
+	stats_peak(STATS_Q_OUTPUT, &session->output);
+	stats_peak(STATS_Q_COMMAND, &session->command);
+	stats_peak(STATS_Q_BENCH, &session->bench_cmd);
+	stats_peak(STATS_Q_SETUP, &session->setup);
+	queue_destroy(&session->script);
+	queue_destroy(&session->control);
+	queue_destroy(&session->testcase);
+	queue_destroy(&session->expected);
+	queue_destroy(&session->input);
+	queue_destroy(&session->output);
+	queue_destroy(&session->command);
+	queue_destroy(&session->bench_cmd);
+	queue_destroy(&session->setup);
+	shrun_lines_free(&session->output_lines);
+	shrun_lines_free(&session->expected_lines);
+	free(session->testcase_indent);
+	free(session->bench_times);
+	free(session->bench_budget);
+	free(session->budget_next);
+	free(session);
+}
@@ -17,10 +17,11 @@
   License along with this program. If not, see http://www.gnu.org/licenses/.
 */
 
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <sys/wait.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <stdio.h>
@@ -28,712 +29,818 @@
 #include <unistd.h>
 #include <string.h>
 #include <libgen.h>
-#include <termios.h>
 #include <limits.h>
-
-#define _GNU_SOURCE
+#include <time.h>
 #include <getopt.h>
 
-#include "queue.h"
-#include "pty_fork.h"
+#include "shrun.h"
+#include "trace.h"
+#include "dist.h"
+#include "history.h"
+#include "matrix.h"
+#include "ab.h"
+#include "soak.h"
+#include "compress.h"
+#include "record.h"
+#include "metrics.h"
 
 #define max(a, b) ((a) > (b) ? (a) : (b))
 
-enum { PIPE_READ, PIPE_WRITE };
-
 static const char *ansi_red = "\033[31m\033[1m";
 static const char *ansi_green = "\033[32m";
 static const char *ansi_clear = "\033[m";
 
-static const char *control_cmds = "timeout() { echo \"timeout $1\" >&109; }\n";
-
-static const char *progname;
+const char *progname;
 
 static const char *opt_shell = "/bin/sh";
 static unsigned int opt_timeout = 5;
 static unsigned int opt_stop_at = (unsigned int)-1;
 static int opt_stderr = 1;
 static int opt_color = -1;
-
-static FILE *ufp = NULL;
-static char *testcase_indent = NULL;
-
-static int append_line(struct queue *queue, const char *line, size_t sz)
+static const char *opt_trace;
+static size_t opt_memory_limit = 64 << 20;
+static size_t opt_output_limit;
+static int opt_isolate;
+static enum shrun_stdin opt_stdin = SHRUN_STDIN_AUTO;
+static enum shrun_channel opt_channel = SHRUN_CHANNEL_PTY;
+static enum shrun_input_wait opt_input_wait = SHRUN_INPUT_WAIT_FAIL;
+static const char *opt_counters;
+static unsigned int opt_repeat;
+static double opt_duration;
+static int opt_reuse_shell;
+static const char *opt_record, *opt_apply;
+static const char *opt_metrics;
+
+static int opt_update_one, opt_update_all;
+static const char *opt_coordinator, *opt_worker;
+
+enum { ORDER_DEFAULT, ORDER_GIVEN, ORDER_HISTORY, ORDER_RANDOM };
+static int opt_order = ORDER_DEFAULT;
+static unsigned int opt_order_seed;
+static int opt_failed_first;
+static const char *opt_history;
+static int opt_stats = -1;  /* -1 = off, or enum shrun_stats_format */
+static const char *opt_ab;
+static unsigned int opt_ab_rounds = 10;
+static double opt_ab_threshold = 10;
+
+static double now(void)
 {
-	size_t append_newline = 1;
-	char *buf;
+	struct timespec ts;
 
-	line++;
-	sz--;
-	if (sz && (*line == ' ')) {
-		line++;
-		sz--;
-	}
-
-	if (sz && line[sz - 1] == '\n')
-		append_newline = 0;
-	buf = queue_write_pos(queue, sz + append_newline, NULL);
-	if (!buf)
-		return -1;
-	memcpy(buf, line, sz);
-	if (append_newline)
-		buf[sz] = '\n';
-	queue_advance_write(queue, sz + append_newline);
-
-	return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-static size_t first_lineno = 1;
+int interrupted;
+void catch_interrupted(int signal)
+{
+	interrupted = 1;
+}
 
-static int read_testcase(struct queue *script, int eof, struct queue *testcase,
-			 struct queue *expected, struct queue *input,
-			 int preamble)
+/*
+  Run sessions to the end. SIGINT is only delivered while waiting for
+  the shells, and ends all the sessions.
+*/
+static void run_sessions(struct shrun_session **sessions, int nsessions)
 {
-	static size_t lineno = 1;
-	char *buf;
-	ssize_t sz;
+	struct pollfd *fds;
+	sigset_t sigset;
 
-	for (;;) {
-		char *end, *newline, *l;
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGHUP);
+	sigaddset(&sigset, SIGINT);
+	sigaddset(&sigset, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigset, NULL);
+	sigemptyset(&sigset);
 
-		buf = queue_read_pos(script, &sz);
-		if (!buf)
-			break;
-		newline = memchr(buf, '\n', sz);
-		if (newline)
-			sz = newline - buf + 1;
-		else if (!eof)
-			break;
+	signal(SIGINT, catch_interrupted);
+	signal(SIGCHLD, SIG_DFL);  /* the sessions reap their shells */
+	signal(SIGPIPE, SIG_IGN);
 
-		l = buf; end = buf + sz;
-		while (l < end && (*l == ' ' || *l == '\t'))
-			l++;
-		if (l == end || *l == '$' || *l == '\n') {
-			if (queue_length(testcase) > preamble) {
-				eof = 1;
-				goto done;
-			}
-			if (l < end && *l == '$') {
-				if (l == buf) {
-					free(testcase_indent);
-					testcase_indent = NULL;
-				} else {
-					testcase_indent =
-						realloc(testcase_indent,
-							l - buf + 1);
-					if (!testcase_indent)
-						return -1;
-					memcpy(testcase_indent, buf,
-					       l - buf);
-					testcase_indent[l - buf] = '\0';
-				}
+	fds = malloc(nsessions * SHRUN_POLLFDS * sizeof(*fds));
+	if (!fds) {
+		while (nsessions--)
+			shrun_session_interrupt(sessions[nsessions]);
+		return;
+	}
+	for(;;) {
+		struct timespec ts, *pts = NULL;
+		int n, nfds, timeout = -1, running = 0, retval;
 
-				first_lineno = lineno;
-				if (opt_stop_at <= first_lineno)
-					return 0;
-				if (append_line(testcase, l, end - l) != 0)
-					return -1;
+		for (n = 0; n < nsessions; n++) {
+			struct pollfd *sfds = fds + n * SHRUN_POLLFDS;
+			int t;
+
+			nfds = shrun_session_pollfds(sessions[n], sfds, &t);
+			if (nfds < 0)
+				nfds = 0;
+			else {
+				running++;
+				if (t >= 0 && (timeout < 0 || t < timeout))
+					timeout = t;
 			}
-		} else if (queue_length(testcase) > preamble) {
-			switch(*l) {
-			case '+':
-				if (append_line(testcase, l, end - l) != 0)
-					return -1;
-				break;
-
-			case '>':
-				if (append_line(expected, l, end - l) != 0)
-					return -1;
-				break;
-
-			case '<':
-				if (append_line(input, l, end - l) != 0)
-					return -1;
-				break;
+			for (; nfds < SHRUN_POLLFDS; nfds++) {
+				sfds[nfds].fd = -1;
+				sfds[nfds].revents = 0;
 			}
 		}
-		if (ufp && l < end && *l != '>') {
-			fwrite(buf, 1, sz, ufp);
+		if (!running)
+			break;
+		if (timeout >= 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000;
+			pts = &ts;
 		}
-		queue_advance_read(script, sz);
-		lineno++;
+		do {
+			retval = ppoll(fds, nsessions * SHRUN_POLLFDS, pts,
+				       &sigset);
+		} while (retval < 0 && errno == EINTR && !interrupted);
+		if (interrupted) {
+			for (n = 0; n < nsessions; n++)
+				shrun_session_interrupt(sessions[n]);
+			break;
+		}
+		for (n = 0; n < nsessions; n++)
+			shrun_session_step(sessions[n],
+					   fds + n * SHRUN_POLLFDS,
+					   retval < 0 ? 0 : SHRUN_POLLFDS);
 	}
-
-done:
-	return eof;
+	free(fds);
 }
 
-static void report_begin(struct queue *testcase, size_t preamble)
+static int shrun(struct shrun_session *session)
 {
-	char *buf, *newline;
-	ssize_t sz;
-
-	buf = queue_read_pos(testcase, &sz);
-	buf += preamble;
-	sz -= preamble;
-	newline = memchr(buf, '\n', sz);
-	if (!newline)
-		newline = buf + sz -1;
-
-	printf("[%u] $ %.*s%s -- ",
-	       (unsigned int)first_lineno, (int)(newline - buf), buf,
-	       (newline == buf + sz - 1) ? "" : "...");
-	fflush(stdout);
+	run_sessions(&session, 1);
+	return shrun_session_result(session);
 }
 
-static int report_end(struct queue *queue1, struct queue *queue2,
-		      int testcase_eof)
+/*
+  Parse a size with an optional k, M, or G suffix.
+*/
+static int parse_size(const char *str, size_t *size)
 {
-	int width = 0;
-	char *buf1, *buf2, *l1, *l2, *eol1, *eol2;
-	ssize_t sz1, sz2, lz1, lz2;
-
-	buf1 = queue_read_pos(queue1, &sz1);
-	buf2 = queue_read_pos(queue2, &sz2);
-	if (!buf1)
-		sz1 = 0;
-	if (!buf2)
-		sz2 = 0;
-	if (testcase_eof && sz1 == sz2 && memcmp(buf1, buf2, sz1) == 0) {
-		printf("%s%s%s\n", ansi_green, "ok", ansi_clear);
-		return 0;
-	}
-	if (!testcase_eof) {
-		printf("%s%s%s\n", ansi_red, "short result", ansi_clear);
-		return 1;
+	unsigned long long n;
+	char *end;
+
+	n = strtoull(str, &end, 10);
+	if (end == str)
+		return -1;
+	switch(*end) {
+	case 'G':
+		n <<= 10;
+		/* fall through */
+	case 'M':
+		n <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		n <<= 10;
+		end++;
 	}
-	printf("%s%s%s\n", ansi_red, "failed", ansi_clear);
-
-	l1 = buf1;
-	eol1 = l1 + sz1;
-	lz1 = 0;
-	for (;;) {
-		if (l1 == eol1 || *l1 == '\n') {
-			if (lz1 > width)
-				width = lz1;
-			if (l1 == eol1)
-				break;
-			lz1 = -1;
-		}
-		l1++;
-		lz1++;
-	}
-	l2 = buf2;
-	eol2 = l2 + sz2;
-	lz2 = 0;
-	for (;;) {
-		if (l2 == eol2 || *l2 == '\n') {
-			if (lz2 > width)
-				width = lz2;
-			if (l2 == eol2)
-				break;
-			lz2 = -1;
-		}
-		l2++;
-		lz2++;
-	}
-
-	l1 = buf1;
-	l2 = buf2;
-	while (sz1 || sz2) {
-		int eq;
-
-		eol1 = memchr(l1, '\n', sz1);
-		if (!eol1) {
-				lz1 = sz1;
-				eol1 = l1 + sz1;
-		} else {
-			lz1 = eol1 - l1;
-			eol1++;
-		}
-		eol2 = memchr(l2, '\n', sz2);
-		if (!eol2) {
-			lz2 = sz2;
-			eol2 = l2 + sz2;
-		} else {
-			lz2 = eol2 - l2;
-			eol2++;
-		}
-		eq = (lz1 == lz2 && memcmp(l1, l2, lz1) == 0);
-		if (!sz1) {
-			l1 = "~"; eol1 = l1;
-			lz1 = 1;
-		}
-		if (!sz2) {
-			l2 = "~"; eol2 = l2;
-			lz2 = 1;
-		}
+	if (*end)
+		return -1;
+	*size = n;
+	return 0;
+}
 
-		printf("%s%-*.*s%s %c %s%.*s%s\n",
-		       eq ? "" : ansi_red, width, (int)lz1, l1, ansi_clear,
-		       eq ? '|' : '?',
-		       eq ? "" : ansi_green, (int)lz2, l2, ansi_clear);
+/*
+  Parse a duration in seconds with an optional s, m, or h suffix.
+*/
+static int parse_duration(const char *str, double *duration)
+{
+	double t;
+	char *end;
 
-		sz1 -= eol1 - l1; l1 = eol1;
-		sz2 -= eol2 - l2; l2 = eol2;
+	t = strtod(str, &end);
+	if (end == str || t <= 0)
+		return -1;
+	switch(*end) {
+	case 'h':
+		t *= 60;
+		/* fall through */
+	case 'm':
+		t *= 60;
+		/* fall through */
+	case 's':
+		end++;
 	}
-	return 1;
+	if (*end)
+		return -1;
+	*duration = t;
+	return 0;
 }
 
-static const char *end_marker_cmd = "echo $'\\4'\n";
+void usage(int status)
+{
+	fprintf(status ? stderr : stdout,
+		"usage: %s [--timeout n] [--stop-at n] [--shell path] "
+		"[--color[={never|always|auto}]] [--no-stderr] "
+		"[--trace file] [--memory-limit size] "
+		"[--output-limit size] [--isolate] "
+		"[--stdin={auto|pty|fifo}] [--channel={pty|file}] "
+		"[--input-wait={fail|eof|timeout}] [--counters=event,...] "
+		"[--repeat n] [--duration time] [--reuse-shell] "
+		"[--record file|--apply file] [--metrics file] "
+		"[--order={given|history|random[:seed]}] [--failed-first] "
+		"[--history file] [--stats[={text|json}]] "
+		"[--ab=A,B [--ab-rounds n] [--ab-threshold percent]] "
+		"[--coordinator addr|--worker addr] [script ...]\n",
+		progname);
+	exit(status);
+}
+
+struct option long_options[] = {
+	{"timeout", 1, NULL, 't'},
+	{"update", 0, NULL, 'u'},
+	{"update-all", 0, NULL, 'U'},
+	{"stop-at", 1, NULL, CHAR_MAX + 1},
+	{"shell", 1, NULL, CHAR_MAX + 2},
+	{"color", 2, NULL, CHAR_MAX + 3},
+	{"no-stderr", 0, NULL, CHAR_MAX + 4},
+	{"trace", 1, NULL, CHAR_MAX + 5},
+	{"memory-limit", 1, NULL, CHAR_MAX + 6},
+	{"output-limit", 1, NULL, CHAR_MAX + 7},
+	{"coordinator", 1, NULL, CHAR_MAX + 8},
+	{"worker", 1, NULL, CHAR_MAX + 9},
+	{"isolate", 0, NULL, CHAR_MAX + 10},
+	{"order", 1, NULL, CHAR_MAX + 11},
+	{"failed-first", 0, NULL, CHAR_MAX + 12},
+	{"history", 1, NULL, CHAR_MAX + 13},
+	{"stats", 2, NULL, CHAR_MAX + 14},
+	{"stdin", 1, NULL, CHAR_MAX + 15},
+	{"channel", 1, NULL, CHAR_MAX + 16},
+	{"ab", 1, NULL, CHAR_MAX + 17},
+	{"ab-rounds", 1, NULL, CHAR_MAX + 18},
+	{"ab-threshold", 1, NULL, CHAR_MAX + 19},
+	{"input-wait", 1, NULL, CHAR_MAX + 20},
+	{"counters", 1, NULL, CHAR_MAX + 21},
+	{"repeat", 1, NULL, CHAR_MAX + 22},
+	{"duration", 1, NULL, CHAR_MAX + 23},
+	{"reuse-shell", 0, NULL, CHAR_MAX + 24},
+	{"record", 1, NULL, CHAR_MAX + 25},
+	{"apply", 1, NULL, CHAR_MAX + 26},
+	{"metrics", 1, NULL, CHAR_MAX + 27},
+	{"help", 0, NULL, 'h'},
+	{NULL, 0, NULL, 0}
+};
 
-static int erase_end_marker(struct queue *output)
+/*
+  Move the updated script into place, and keep the original as a backup.
+*/
+static int replace_script(const char *script, const char *tmpfile)
 {
-	char *buf;
-	ssize_t sz;
+	struct stat st;
+	char *backup;
+	int retval = -1;
 
-	buf = queue_read_pos(output, &sz);
-	if (buf && sz >= 2 && buf[sz - 2] == '\4' && buf[sz - 1] == '\n') {
-		queue_erase_tail(output, 2);
-		return 0;
-	}
-	return -1;
+	backup = malloc(strlen(script) + 2);
+	if (!backup)
+		return -1;
+	sprintf(backup, "%s~", script);
+	if (stat(script, &st) == 0 &&
+	    chmod(tmpfile, st.st_mode) == 0 &&
+	    rename(script, backup) == 0 &&
+	    rename(tmpfile, script) == 0)
+		retval = 0;
+	free(backup);
+	return retval;
 }
 
-int interrupted;
-void catch_interrupted(int signal)
+/*
+  Open a script for reading, through its decompressor if it is compressed
+  (*pid is then set, and -1 otherwise).
+*/
+static int open_script(const char *script, pid_t *pid)
 {
-	interrupted = 1;
+	const char *z = compressor(script);
+	int fd, zfd;
+
+	*pid = -1;
+	fd = open(script, O_RDONLY);
+	if (fd < 0 || !z)
+		return fd;
+	*pid = compress_start(z, 1, fd, &zfd);
+	close(fd);
+	return *pid < 0 ? -1 : zfd;
 }
 
-pid_t child_pid;
-#if 0
-int child_status;
-void catch_child_died(int signal)
+/* Returns -1 if the script could not be decompressed. */
+static int close_script(int fd, pid_t pid)
 {
-	int saved_errno;
+	close(fd);
+	return pid == -1 ? 0 : compress_wait(pid);
+}
+
+/*
+  Report like the shrun command does, and remember how long each command
+  took in the history.
+*/
+struct run_report {
+	struct shrun_text_report text;
+	const char *key;		/* for the history, or NULL */
+	const char *name;
+};
+
+static void run_begin(void *priv, const struct shrun_command *command)
+{
+	struct run_report *report = priv;
 
-	saved_errno = errno;
-	waitpid(child_pid, &child_status, WNOHANG);
-	errno = saved_errno;
+	shrun_text_callbacks.begin(&report->text, command);
 }
-#endif
 
-static int interactive(int in, int out)
+static void run_result(void *priv, const struct shrun_command *command)
 {
-	struct queue input, output;
-	sigset_t sigset;
-	int stdin_eof = 0, interactive_eof = 0, retval = 0;
+	struct run_report *report = priv;
+
+	shrun_text_callbacks.result(&report->text, command);
+	if (report->key)
+		history_record(report->key, command->lineno,
+			       command->duration, !command->passed);
+	record_command(command);
+	metrics_command(report->name ? report->name : "-", command);
+}
 
-	sigemptyset(&sigset);
-	queue_init(&input);
-	queue_init(&output);
+static void run_run(void *priv, double duration)
+{
+	metrics_run(duration);
+}
 
-	printf("%sinteractive; press ^D to continue%s\n",
-	      ansi_red, ansi_clear);
-	fflush(stdout);
+static void run_interactive(void *priv)
+{
+	struct run_report *report = priv;
 
-	for(;;) {
-		fd_set rfds, wfds;
-		int maxfd = 0, retval2;
-
-		FD_ZERO(&rfds);
-		FD_ZERO(&wfds);
-		if (!stdin_eof) {
-			FD_SET(STDIN_FILENO, &rfds);
-			maxfd = max(maxfd, STDIN_FILENO + 1);
-		}
-		if (!queue_empty(&input)) {
-			FD_SET(out, &wfds);
-			maxfd = max(maxfd, out + 1);
-		}
-		FD_SET(in, &rfds);
-		maxfd = max(maxfd, in + 1);
-		do {
-			retval2 = pselect(maxfd, &rfds, &wfds, NULL, NULL,
-					  &sigset);
-		} while (retval2 < 0 && errno == EINTR && !interrupted);
-		if (retval2 < 0)
-			break;
-		if (FD_ISSET(STDIN_FILENO, &rfds)) {
-			char *buf;
-			ssize_t sz;
-
-			buf = queue_write_pos(&input, 256, &sz);
-			if (!buf)
-				break;
-			sz = read(STDIN_FILENO, buf, sz);
-			if (sz < 0)
-				break;
-			queue_advance_write(&input, sz);
-			if (sz == 0) {
-				stdin_eof = 1;
-
-				if (queue_append(&input, end_marker_cmd) != 0)
-					return -1;
-			}
-		}
-		if (FD_ISSET(out, &wfds)) {
-			char *buf;
-			ssize_t sz;
-
-			buf = queue_read_pos(&input, &sz);
-			if (buf) {
-				sz = write(out, buf, sz);
-				if (sz < 0)
-					break;
-			}
-			queue_advance_read(&input, sz);
+	shrun_text_callbacks.interactive(&report->text);
+}
+
+static void run_end(void *priv, const struct shrun_summary *summary)
+{
+	struct run_report *report = priv;
+
+	shrun_text_callbacks.end(&report->text, summary);
+}
+
+static const struct shrun_callbacks run_callbacks = {
+	.begin = run_begin,
+	.result = run_result,
+	.run = run_run,
+	.interactive = run_interactive,
+	.end = run_end,
+};
+
+static void init_options(struct shrun_options *options)
+{
+	shrun_options_init(options);
+	options->shell = opt_shell;
+	options->timeout = opt_timeout;
+	options->no_stderr = !opt_stderr;
+	options->isolate = opt_isolate;
+	options->stdin_mode = opt_stdin;
+	options->channel = opt_channel;
+	options->input_wait = opt_input_wait;
+	options->counters = opt_counters;
+	options->memory_limit = opt_memory_limit;
+	options->output_limit = opt_output_limit;
+}
+
+/*
+  Split a comma separated list of shells. The list and the names point
+  into *copy.
+*/
+static int split_shells(const char *shells, char **copy, const char ***list)
+{
+	char *p;
+	int n = 1;
+
+	*copy = strdup(shells);
+	if (!*copy)
+		return -1;
+	for (p = *copy; (p = strchr(p, ',')); p++)
+		n++;
+	*list = malloc(n * sizeof(**list));
+	if (!*list) {
+		free(*copy);
+		return -1;
+	}
+	n = 0;
+	for (p = strtok(*copy, ","); p; p = strtok(NULL, ","))
+		(*list)[n++] = p;
+	return n;
+}
+
+/*
+  Run a script in several shells at the same time, and report the results
+  side by side.
+*/
+static int run_matrix(const char *script, const char *name)
+{
+	struct shrun_session **sessions = NULL;
+	struct shrun_options options;
+	struct matrix *matrix = NULL;
+	const char **shells;
+	char *copy;
+	int *fds = NULL, nshells, n, retval = 2;
+	pid_t *pids = NULL;
+
+	if (!script || opt_update_one || opt_update_all ||
+	    opt_stop_at != (unsigned int)-1) {
+		fprintf(stderr, "%s: several shells require script filenames, "
+			"and do not work with --update or --stop-at\n",
+			progname);
+		return 2;
+	}
+	nshells = split_shells(opt_shell, &copy, &shells);
+	if (nshells < 0) {
+		perror(progname);
+		return 2;
+	}
+	sessions = calloc(nshells, sizeof(*sessions));
+	fds = malloc(nshells * sizeof(*fds));
+	pids = malloc(nshells * sizeof(*pids));
+	matrix = matrix_new(shells, nshells, stdout, *ansi_clear != 0);
+	if (!sessions || !fds || !pids || !matrix) {
+		perror(progname);
+		goto out;
+	}
+	for (n = 0; n < nshells; n++) {
+		fds[n] = -1;
+		pids[n] = -1;
+	}
+
+	init_options(&options);
+	for (n = 0; n < nshells; n++) {
+		fds[n] = open_script(script, &pids[n]);
+		if (fds[n] < 0) {
+			fprintf(stderr, "%s: %s: %s\n",
+			        progname, name, strerror(errno));
+			goto out;
 		}
-		if (FD_ISSET(in, &rfds)) {
-			char *buf;
-			ssize_t sz;
-
-			buf = queue_write_pos(&output, 256, &sz);
-			if (!buf)
-				break;
-			sz = read(in, buf, sz);
-			if (sz <= 0)
-				break;
-			queue_advance_write(&output, sz);
-
-			if (erase_end_marker(&output) == 0)
-				interactive_eof = 1;
-			for(;;) {
-
-				buf = queue_read_pos(&output, &sz);
-				if (!buf)
-					break;
-				sz = write(STDOUT_FILENO, buf, sz);
-				if (sz <= 0)
-					break;
-				queue_advance_read(&output, sz);
-			}
-			if (interactive_eof)
-				goto out;
+		options.shell = shells[n];
+		sessions[n] = shrun_session_new(&options, fds[n],
+						&matrix_callbacks,
+						matrix_priv(matrix, n));
+		if (!sessions[n] || shrun_session_start(sessions[n]) != 0) {
+			perror(progname);
+			goto out;
 		}
 	}
-	retval = -1;
+	run_sessions(sessions, nshells);
+	retval = matrix_result(matrix);
 
 out:
-	queue_destroy(&input);
-	queue_destroy(&output);
+	for (n = 0; sessions && n < nshells; n++)
+		shrun_session_free(sessions[n]);
+	for (n = 0; fds && pids && n < nshells; n++) {
+		if (fds[n] >= 0 && close_script(fds[n], pids[n]) != 0) {
+			fprintf(stderr, "%s: %s: cannot decompress\n",
+				progname, name);
+			retval = 2;
+		}
+	}
+	free(sessions);
+	free(fds);
+	free(pids);
+	matrix_free(matrix);
+	free(shells);
+	free(copy);
 	return retval;
 }
 
-static int shrun(int script_fd, int in, int out, int control_fd)
+/*
+  Run a script in the two configurations of --ab, taking turns for each
+  run of each command, and compare how long the commands took.
+*/
+static int run_ab(const char *script, const char *name)
 {
-	struct queue script, control, testcase, expected, input, output;
-	int script_eof = 0, in_eof = 0, testcase_eof = 0;
-	int reading_testcase = 1, retval = 0;
-	int passed = 0, failed = 0, timed_out = 0;
-	size_t preamble = 0;
-	struct termios term;
-	sigset_t sigset;
-
-	if (isatty(out)) {
-		if (tcgetattr(out, &term) < 0) {
-			fprintf(stderr, "%s%s: %s%s\n", ansi_red, progname,
-				strerror(errno), ansi_clear);
-			return 1;
+	struct shrun_session *sessions[2] = { };
+	struct shrun_options options;
+	struct ab *ab;
+	int fds[2] = { -1, -1 }, n, retval = 2;
+	pid_t pids[2] = { -1, -1 };
+
+	if (!script || opt_update_one || opt_update_all ||
+	    opt_stop_at != (unsigned int)-1) {
+		fprintf(stderr, "%s: --ab requires script filenames, and does "
+			"not work with --update or --stop-at\n", progname);
+		return 2;
+	}
+	ab = ab_new(opt_ab, opt_ab_rounds, opt_ab_threshold, stdout,
+		    *ansi_clear != 0);
+	if (!ab) {
+		fprintf(stderr, "%s: --ab=%s: %s\n",
+			progname, opt_ab, strerror(errno));
+		return 2;
+	}
+	for (n = 0; n < 2; n++) {
+		init_options(&options);
+		ab_options(ab, n, &options);
+		if (access(options.shell, X_OK) != 0) {
+			fprintf(stderr, "%s: %s: %s\n",
+				progname, options.shell, strerror(errno));
+			goto out;
 		}
-		
-		/* Turn off terminal echo. */
-		term.c_lflag &= ~(ECHO | ECHOE | ECHOK | ECHONL);
-		
-		/* Turn off '\n' to '\r\n' translation. */
-		term.c_oflag &= ~(ONLCR);
-
-		if (tcsetattr(out, TCSANOW, &term) < 0) {
-			fprintf(stderr, "%s%s: %s%s\n", ansi_red, progname,
-				strerror(errno), ansi_clear);
-			return -1;
+		fds[n] = open_script(script, &pids[n]);
+		if (fds[n] < 0) {
+			fprintf(stderr, "%s: %s: %s\n",
+			        progname, name, strerror(errno));
+			goto out;
+		}
+		sessions[n] = shrun_session_new(&options, fds[n],
+						&ab_callbacks, ab_priv(ab, n));
+		if (!sessions[n] || shrun_session_start(sessions[n]) != 0) {
+			perror(progname);
+			goto out;
 		}
 	}
+	ab_start(ab, sessions[0], sessions[1]);
+	run_sessions(sessions, 2);
+	retval = ab_result(ab);
 
-	sigemptyset(&sigset);
-	sigaddset(&sigset, SIGHUP);
-	sigaddset(&sigset, SIGINT);
-	sigaddset(&sigset, SIGCHLD);
-	sigprocmask(SIG_BLOCK, &sigset, NULL);
-	sigemptyset(&sigset);
-
-	signal(SIGINT, catch_interrupted);
-	signal(SIGCHLD, SIG_IGN /*catch_child_died*/);
-	signal(SIGPIPE, SIG_IGN);
-
-	queue_init(&script);
-	queue_init(&control);
-	queue_init(&testcase);
-	queue_init(&expected);
-	queue_init(&input);
-	queue_init(&output);
-
-	if (queue_append(&testcase, control_cmds) != 0)
-		return -1;
-	preamble = queue_length(&testcase);
+out:
+	for (n = 0; n < 2; n++) {
+		shrun_session_free(sessions[n]);
+		if (fds[n] >= 0 && close_script(fds[n], pids[n]) != 0) {
+			fprintf(stderr, "%s: %s: cannot decompress\n",
+				progname, name);
+			retval = 2;
+		}
+	}
+	ab_free(ab);
+	return retval;
+}
 
-	for(;;) {
-		fd_set rfds, wfds;
-		int maxfd = 0, retval2;
-		struct timespec timeout, *ptimeout = NULL;
+/*
+  Run a script over and over for --repeat or --duration, in a new shell
+  each time or all in one shell, and only report how the commands did
+  over all iterations.
+*/
+static int run_soak(const char *script, const char *name)
+{
+	struct shrun_session *session = NULL;
+	struct shrun_options options;
+	struct soak *soak;
+	int fd = -1, retval = 2;
+	pid_t pid = -1;
+
+	if (!script || opt_update_one || opt_update_all ||
+	    opt_stop_at != (unsigned int)-1 || opt_ab ||
+	    strchr(opt_shell, ',')) {
+		fprintf(stderr, "%s: --repeat and --duration require script "
+			"filenames, and do not work with --update, --stop-at, "
+			"--ab, or several shells\n", progname);
+		return 2;
+	}
+	soak = soak_new(opt_repeat, opt_duration, stdout, *ansi_clear != 0);
+	if (!soak) {
+		perror(progname);
+		return 2;
+	}
+	init_options(&options);
+	if (opt_reuse_shell) {
+		int sfd;
 
-		if (!reading_testcase && (testcase_eof || in_eof)) {
-			if (report_end(&output, &expected, testcase_eof) == 0)
-				passed++;
-			else
-				failed++;
-			if (ufp) {
-				char *buf, *l;
-				ssize_t sz;
-
-				buf = queue_read_pos(&output, &sz);
-				while (sz) {
-					size_t lsz;
-
-					l = memchr(buf, '\n', sz);
-					if (l)
-						lsz = l - buf + 1;
-					else
-						lsz = sz;
-					if (testcase_indent)
-						fputs(testcase_indent, ufp);
-					fprintf(ufp, "> %.*s", (int)lsz, buf);
-					if (!l)
-						fputs("\n", ufp);
-					buf += lsz;
-					sz -= lsz;
-				}
-			}
-			queue_reset(&expected);
-			queue_reset(&input);
-			queue_reset(&output);
-			reading_testcase = 1;
-			preamble = 0;
+		fd = open_script(script, &pid);
+		if (fd < 0) {
+			fprintf(stderr, "%s: %s: %s\n",
+			        progname, name, strerror(errno));
+			goto out;
 		}
-		if (reading_testcase) {
-			if (script_eof && queue_empty(&script) &&
-			    queue_length(&testcase) == preamble)
-				goto out;
-
-			retval2 = read_testcase(&script, script_eof, &testcase,
-						&expected, &input, preamble);
-			if (retval2 < 0)
-				break;
-			if (retval2 > 0) {
-				report_begin(&testcase, preamble);
-
-				if (!queue_empty(&input)) {
-					char *buf1, *buf2;
-					ssize_t sz;
-
-					buf1 = queue_read_pos(&input, &sz);
-					buf2 = queue_write_pos(&testcase,
-							       sz + 1, NULL);
-					if (!buf2)
-						break;
-					memcpy(buf2, buf1, sz);
-					buf2[sz] = term.c_cc[VEOF];
-					queue_advance_read(&input, sz);
-					queue_advance_write(&testcase, sz + 1);
-				}
-				if (queue_append(&testcase,
-						 end_marker_cmd) != 0)
-					return -1;
-				reading_testcase = 0;
-				testcase_eof = 0;
-			}
+		sfd = soak_script(soak, fd);
+		if (sfd < 0) {
+			fprintf(stderr, "%s: %s: %s\n",
+			        progname, name, strerror(errno));
+			goto out;
 		}
-		if (opt_stop_at <= first_lineno) {
-			retval2 = interactive(in, out);
-			if (retval2 < 0)
-				break;
-			opt_stop_at = (unsigned int)-1;
+		if (close_script(fd, pid) != 0) {
+			fd = -1;
+			goto fail_decompress;
 		}
-
-		FD_ZERO(&rfds);
-		FD_ZERO(&wfds);
-		if (reading_testcase) {
-			if (!script_eof) {
-				FD_SET(script_fd, &rfds);
-				maxfd = max(maxfd, script_fd + 1);
-			}
-		} else {
-			if (!in_eof) {
-				FD_SET(in, &rfds);
-				maxfd = max(maxfd, in + 1);
-			}
-			if (!queue_empty(&testcase)) {
-				FD_SET(out, &wfds);
-				maxfd = max(maxfd, out + 1);
+		fd = -1;
+		session = shrun_session_new(&options, sfd, &soak_callbacks,
+					    soak);
+		if (!session || shrun_session_start(session) != 0) {
+			perror(progname);
+			goto out;
+		}
+		soak_session(soak, session);
+		run_sessions(&session, 1);
+	} else {
+		while (!interrupted && soak_next(soak)) {
+			fd = open_script(script, &pid);
+			if (fd < 0) {
+				fprintf(stderr, "%s: %s: %s\n",
+					progname, name, strerror(errno));
+				goto out;
 			}
-			if (!queue_empty(&input)) {
-				FD_SET(out, &wfds);
-				maxfd = max(maxfd, out + 1);
+			session = shrun_session_new(&options, fd,
+						    &soak_callbacks, soak);
+			if (!session || shrun_session_start(session) != 0) {
+				perror(progname);
+				goto out;
 			}
-
-			if (opt_timeout) {
-				ptimeout = &timeout;
-				timeout.tv_sec = opt_timeout;
-				timeout.tv_nsec = 0;
+			soak_session(soak, session);
+			run_sessions(&session, 1);
+			shrun_session_free(session);
+			session = NULL;
+			if (close_script(fd, pid) != 0) {
+				fd = -1;
+				goto fail_decompress;
 			}
+			fd = -1;
 		}
-		if (control_fd != -1) {
-			FD_SET(control_fd, &rfds);
-			maxfd = max(maxfd, control_fd + 1);
-		}
+	}
+	retval = soak_result(soak);
 
-		do {
-			retval2 = pselect(maxfd, &rfds, &wfds, NULL,
-				  ptimeout, &sigset);
-		} while (retval2 < 0 && errno == EINTR && !interrupted);
-		if (retval2 < 0 || interrupted)
-			break;
-		if (!reading_testcase && retval2 == 0) {
-			timed_out = 1;
-			break;
+out:
+	shrun_session_free(session);
+	if (fd >= 0)
+		close_script(fd, pid);
+	soak_free(soak);
+	return retval;
+
+fail_decompress:
+	fprintf(stderr, "%s: %s: cannot decompress\n", progname, name);
+	goto out;
+}
+
+/*
+  Run one script (or standard input if script is NULL) in a new shell.
+  Messages refer to the script by name, and commands are recorded in the
+  history under key, unless it is NULL. Returns 0 if all commands
+  succeeded, 1 if some failed, and 2 on errors.
+*/
+static int run_script(const char *script, const char *name, const char *key)
+{
+	struct shrun_options options;
+	struct run_report report;
+	struct shrun_session *session;
+	int retval = 0;
+	int script_fd = STDIN_FILENO;
+	char *tmpfile = NULL;
+	FILE *ufp = NULL;
+	pid_t script_pid = -1, upid = -1;
+
+	if (opt_repeat || opt_duration)
+		return run_soak(script, name);
+	if (opt_ab)
+		return run_ab(script, name);
+	if (strchr(opt_shell, ','))
+		return run_matrix(script, name);
+	if ((opt_record || opt_apply) && !script) {
+		fprintf(stderr, "%s: --record and --apply require script "
+			"filenames\n", progname);
+		return 2;
+	}
+	if (opt_apply && replay_script(script) != 0) {
+		fprintf(stderr, "%s: %s: not in %s, or changed since it was "
+			"recorded\n", progname, name, opt_apply);
+		return 2;
+	}
+	if (opt_record && record_script(script) != 0) {
+		fprintf(stderr, "%s: %s: %s\n",
+			progname, name, strerror(errno));
+		return 2;
+	}
+	if (script) {
+		script_fd = open_script(script, &script_pid);
+		if (script_fd < 0) {
+			fprintf(stderr, "%s: %s: %s\n",
+			        progname, name, strerror(errno));
+			return 1;
 		}
+	}
+	/* Applying a recording updates the script. */
+	if (opt_update_one || opt_update_all || opt_apply) {
+		const char *z = script ? compressor(script) : NULL;
+		int ufd;
 
-		if (FD_ISSET(script_fd, &rfds)) {
-			char *buf;
-			ssize_t sz;
-
-			buf = queue_write_pos(&script, 256, &sz);
-			if (!buf)
-				break;
-			sz = read(script_fd, buf, sz);
-			if (sz < 0)
-				break;
-			queue_advance_write(&script, sz);
-			if (sz == 0)
-				script_eof = 1;
+		if (!script) {
+			fprintf(stderr, "%s: update requires a script "
+				"filename\n", progname);
+			return 1;
 		}
-		if (FD_ISSET(out, &wfds)) {
-			char *buf;
-			ssize_t sz;
-
-			buf = queue_read_pos(&input, &sz);
-			if (!in_eof) {
-				sz = write(out, buf, sz);
-				if (sz < 0)
-					break;
-			}
-			queue_advance_read(&input, sz);
+		tmpfile = malloc(strlen(script) + 8);
+		if (!tmpfile)
+			goto fail_unlink;
+		sprintf(tmpfile, "%s.XXXXXX", script);
+		ufd = mkstemp(tmpfile);
+		if (ufd == -1) {
+			fprintf(stderr, "%s: %s: %s\n",
+			        progname, tmpfile, strerror(errno));
+			free(tmpfile);
+			tmpfile = NULL;
+			retval = 2;
+			goto out;
 		}
-		if (FD_ISSET(out, &wfds) || (!reading_testcase && in_eof)) {
-			char *buf;
-			ssize_t sz;
-
-			buf = queue_read_pos(&testcase, &sz);
-			if (!in_eof) {
-				sz = write(out, buf, sz);
-				if (sz < 0)
-					break;
-			}
-			queue_advance_read(&testcase, sz);
+		if (z) {
+			/* Compress the updated script in the same format. */
+			int zfd;
+
+			upid = compress_start(z, 0, ufd, &zfd);
+			close(ufd);
+			if (upid < 0)
+				goto fail_unlink;
+			ufd = zfd;
 		}
-		if (FD_ISSET(in, &rfds)) {
-			char *buf;
-			ssize_t sz;
-
-			buf = queue_write_pos(&output, 256, &sz);
-			if (!buf)
-				return -1;
-			sz = read(in, buf, sz);
-			if (sz == 0)
-				in_eof = 1;
-			else if (sz < 0)
-				break;
-			else {
-				queue_advance_write(&output, sz);
-				if (erase_end_marker(&output) == 0)
-					testcase_eof = 1;
-			}
+		ufp = fdopen(ufd, "w");
+		if (!ufp)
+			goto fail_unlink;
+	}
+
+	init_options(&options);
+	if (script_fd != STDIN_FILENO)
+		options.stop_at = opt_stop_at;
+	options.update = ufp;
+	if (opt_apply) {
+		options.replay = replay_command;
+		options.counters = NULL;
+	}
+	shrun_text_report_init(&report.text, stdout, *ansi_clear != 0);
+	report.key = opt_apply ? NULL : key;
+	report.name = name;
+
+	session = shrun_session_new(&options, script_fd,
+				    &run_callbacks, &report);
+	if (!session || shrun_session_start(session) != 0) {
+		perror(progname);
+		shrun_session_free(session);
+		retval = 2;
+		goto out;
+	}
+	retval = shrun(session);
+	shrun_session_free(session);
+	if (script_fd != STDIN_FILENO) {
+		if (close_script(script_fd, script_pid) != 0) {
+			fprintf(stderr, "%s: %s: cannot decompress\n",
+				progname, name);
+			retval = -1;
 		}
-		if (control_fd != -1 && FD_ISSET(control_fd, &rfds)) {
-			char *buf;
-			ssize_t sz;
-
-			buf = queue_write_pos(&control, 256, &sz);
-			if (!buf)
-				return -1;
-			sz = read(control_fd, buf, sz);
-			if (sz == 0) {
-				close(control_fd);
-				control_fd = -1;
-			} else if (sz < 0)
-				break;
-			else {
-				queue_advance_write(&control, sz);
-				buf = queue_read_pos(&control, &sz);
-				if (buf[sz - 1] == '\n') {
-					if (strncmp(buf, "timeout ", 8) == 0)
-						opt_timeout = atoi(buf + 8);
-					else {
-						fprintf(stderr, "%sunknown "
-							"control command%s\n",
-							ansi_red, ansi_clear);
-						break;
-					}
-					queue_advance_read(&control, sz);
+		script_fd = STDIN_FILENO;
+	}
+	if (retval >= 0) {
+		if (ufp && retval != 0) {
+			if (ferror(ufp)) {
+				errno = EIO;
+				goto fail_unlink;
+			}
+			if (fclose(ufp)) {
+				ufp = NULL;
+				goto fail_unlink;
+			}
+			ufp = NULL;
+			if (upid != -1) {
+				int failed = compress_wait(upid);
+
+				upid = -1;
+				if (failed) {
+					fprintf(stderr, "%s: %s: cannot "
+						"compress\n", progname, name);
+					retval = 2;
+					goto out;
 				}
 			}
+			if (opt_update_one && retval > 1) {
+				fprintf(stderr, "%snot updating %s "
+					"(too many changes)%s\n",
+					ansi_red, name, ansi_clear);
+				retval = 2;
+				goto out;
+			}
+			if (replace_script(script, tmpfile) != 0)
+				goto fail_unlink;
+			printf("%s%s updated%s\n",
+			       ansi_green, name, ansi_clear);
+			free(tmpfile);
+			tmpfile = NULL;
 		}
-	}
-	retval = -1;
-
-out:
-	queue_destroy(&script);
-	queue_destroy(&control);
-	queue_destroy(&testcase);
-	queue_destroy(&expected);
-	queue_destroy(&input);
-	queue_destroy(&output);
-
-	failed++;
-	if (timed_out)
-		printf("%scommand timed out%s\n",
-			ansi_red, ansi_clear);
-	else if (interrupted)
-		printf("%sinterrupted%s\n",
-		       ansi_red, ansi_clear);
-	else if (retval == 0) {
-		failed--;
-		if (passed + failed > 0)
-			printf("%s%u commands (%u passed, %u failed)\%s\n",
-			       (failed == 0) ? ansi_green : ansi_red,
-			       (int)(passed + failed),
-			       (int)passed, (int)failed, ansi_clear);
+		if (retval != 0)
+			retval = 1;
 	} else
-		printf("%s%s%s\n", ansi_red, strerror(errno), ansi_clear);
+		retval = 2;
 
-	if (failed && !retval)
-		retval = failed;
+out:
+	if (ufp)
+		fclose(ufp);
+	if (upid != -1)
+		compress_wait(upid);
+	if (tmpfile) {
+		unlink(tmpfile);
+		free(tmpfile);
+	}
+	if (script_fd != STDIN_FILENO)
+		close_script(script_fd, script_pid);
 	return retval;
-}
 
-void usage(int status)
-{
-	fprintf(status ? stderr : stdout,
-		"usage: %s [--timeout n] [--stop-at n] [--shell path] "
-		"[--color[={never|always|auto}]] [--no-stderr]\n",
-		progname);
-	exit(status);
+fail_unlink:
+	fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+	retval = 2;
+	goto out;
 }
 
-struct option long_options[] = {
-	{"timeout", 1, NULL, 't'},
-	{"update", 0, NULL, 'u'},
-	{"update-all", 0, NULL, 'U'},
-	{"stop-at", 1, NULL, CHAR_MAX + 1},
-	{"shell", 1, NULL, CHAR_MAX + 2},
-	{"color", 2, NULL, CHAR_MAX + 3},
-	{"no-stderr", 0, NULL, CHAR_MAX + 4},
-	{"help", 0, NULL, 'h'},
-	{NULL, 0, NULL, 0}
-};
-
-int main(int argc, char *argv[])
+static void parse_options(int argc, char *argv[])
 {
-	int ptm, output[2], control[2];
-	int retval = 0;
-	char *script = NULL;
-	int script_fd = STDIN_FILENO;
-	int update_one = 0, update_all = 0;
-	char *tmpfile = NULL;
 	int c;
 
-	progname = basename(argv[0]);
+	optind = 0;
 	while ((c = getopt_long(argc, argv, "t:uUh",
 				long_options, NULL)) != -1) {
 		switch(c) {
@@ -742,11 +849,11 @@ int main(int argc, char *argv[])
 			break;
 
 		case 'u':  /* --update */
-			update_one = 1;
+			opt_update_one = 1;
 			break;
 
 		case 'U':  /*  --update-all */
-			update_all = 1;
+			opt_update_all = 1;
 			break;
 
 		case CHAR_MAX + 1:  /* --stop-at */
@@ -772,140 +879,479 @@ int main(int argc, char *argv[])
 			opt_stderr = 0;
 			break;
 
+		case CHAR_MAX + 5:  /* --trace */
+			opt_trace = optarg;
+			break;
+
+		case CHAR_MAX + 6:  /* --memory-limit */
+			if (parse_size(optarg, &opt_memory_limit) != 0)
+				usage(1);
+			break;
+
+		case CHAR_MAX + 7:  /* --output-limit */
+			if (parse_size(optarg, &opt_output_limit) != 0)
+				usage(1);
+			break;
+
+		case CHAR_MAX + 8:  /* --coordinator */
+			opt_coordinator = optarg;
+			break;
+
+		case CHAR_MAX + 9:  /* --worker */
+			opt_worker = optarg;
+			break;
+
+		case CHAR_MAX + 10:  /* --isolate */
+			opt_isolate = 1;
+			break;
+
+		case CHAR_MAX + 11:  /* --order */
+			if (strcmp(optarg, "given") == 0)
+				opt_order = ORDER_GIVEN;
+			else if (strcmp(optarg, "history") == 0)
+				opt_order = ORDER_HISTORY;
+			else if (strcmp(optarg, "random") == 0) {
+				opt_order = ORDER_RANDOM;
+				opt_order_seed = time(NULL) ^ getpid();
+			} else if (strncmp(optarg, "random:", 7) == 0) {
+				opt_order = ORDER_RANDOM;
+				opt_order_seed = strtoul(optarg + 7, NULL, 0);
+			} else
+				usage(1);
+			break;
+
+		case CHAR_MAX + 12:  /* --failed-first */
+			opt_failed_first = 1;
+			break;
+
+		case CHAR_MAX + 13:  /* --history */
+			opt_history = optarg;
+			break;
+
+		case CHAR_MAX + 14:  /* --stats */
+			if (optarg == NULL || strcmp(optarg, "text") == 0)
+				opt_stats = SHRUN_STATS_TEXT;
+			else if (strcmp(optarg, "json") == 0)
+				opt_stats = SHRUN_STATS_JSON;
+			else
+				usage(1);
+			break;
+
+		case CHAR_MAX + 15:  /* --stdin */
+			if (strcmp(optarg, "auto") == 0)
+				opt_stdin = SHRUN_STDIN_AUTO;
+			else if (strcmp(optarg, "pty") == 0)
+				opt_stdin = SHRUN_STDIN_PTY;
+			else if (strcmp(optarg, "fifo") == 0)
+				opt_stdin = SHRUN_STDIN_FIFO;
+			else
+				usage(1);
+			break;
+
+		case CHAR_MAX + 16:  /* --channel */
+			if (strcmp(optarg, "pty") == 0)
+				opt_channel = SHRUN_CHANNEL_PTY;
+			else if (strcmp(optarg, "file") == 0)
+				opt_channel = SHRUN_CHANNEL_FILE;
+			else
+				usage(1);
+			break;
+
+		case CHAR_MAX + 17:  /* --ab */
+			opt_ab = optarg;
+			break;
+
+		case CHAR_MAX + 18:  /* --ab-rounds */
+			opt_ab_rounds = atoi(optarg);
+			if (opt_ab_rounds < 1)
+				usage(1);
+			break;
+
+		case CHAR_MAX + 19: {  /* --ab-threshold */
+			char *end;
+
+			opt_ab_threshold = strtod(optarg, &end);
+			if (end == optarg || *end || opt_ab_threshold < 0)
+				usage(1);
+			break;
+		}
+
+		case CHAR_MAX + 20:  /* --input-wait */
+			if (strcmp(optarg, "fail") == 0)
+				opt_input_wait = SHRUN_INPUT_WAIT_FAIL;
+			else if (strcmp(optarg, "eof") == 0)
+				opt_input_wait = SHRUN_INPUT_WAIT_EOF;
+			else if (strcmp(optarg, "timeout") == 0)
+				opt_input_wait = SHRUN_INPUT_WAIT_TIMEOUT;
+			else
+				usage(1);
+			break;
+
+		case CHAR_MAX + 21:  /* --counters */
+			if (shrun_counters_check(optarg) != 0)
+				usage(1);
+			opt_counters = optarg;
+			break;
+
+		case CHAR_MAX + 22:  /* --repeat */
+			opt_repeat = atoi(optarg);
+			if (opt_repeat < 1)
+				usage(1);
+			break;
+
+		case CHAR_MAX + 23:  /* --duration */
+			if (parse_duration(optarg, &opt_duration) != 0)
+				usage(1);
+			break;
+
+		case CHAR_MAX + 24:  /* --reuse-shell */
+			opt_reuse_shell = 1;
+			break;
+
+		case CHAR_MAX + 25:  /* --record */
+			opt_record = optarg;
+			break;
+
+		case CHAR_MAX + 26:  /* --apply */
+			opt_apply = optarg;
+			break;
+
+		case CHAR_MAX + 27:  /* --metrics */
+			opt_metrics = optarg;
+			break;
+
 		case 'h':
 			usage(0);
 			break;
 
 		case '?':
-			return 1;
+			exit(1);
+		}
+	}
+}
+
+/*
+  Run a script on behalf of a coordinator, with the options the
+  coordinator was started with.
+*/
+static int run_remote_script(char **options, int noptions,
+			     const char *script, const char *name)
+{
+	char **argv;
+	int retval;
+
+	argv = malloc((noptions + 2) * sizeof(*argv));
+	if (!argv)
+		return 2;
+	argv[0] = (char *)progname;
+	memcpy(argv + 1, options, noptions * sizeof(*argv));
+	argv[noptions + 1] = NULL;
+	parse_options(noptions + 1, argv);
+	if (opt_color == 0)
+		ansi_red = ansi_green = ansi_clear = "";
+	retval = run_script(script, name, NULL);
+	free(argv);
+	return retval;
+}
+
+struct script_order {
+	char *script;
+	double duration;
+	off_t size;
+	int failed, index;
+};
+
+static int compare_scripts(const void *a, const void *b)
+{
+	const struct script_order *x = a, *y = b;
+
+	if (opt_failed_first && x->failed != y->failed)
+		return y->failed - x->failed;
+	if (opt_order == ORDER_HISTORY) {
+		/* Scripts we know nothing about might take long. */
+		if ((x->duration < 0) != (y->duration < 0))
+			return x->duration < 0 ? -1 : 1;
+		if (x->duration != y->duration)
+			return x->duration > y->duration ? -1 : 1;
+		if (x->size != y->size)
+			return x->size > y->size ? -1 : 1;
+	}
+	return x->index - y->index;
+}
+
+/*
+  Put the scripts in the order in which they should run: as given, at
+  random, or longest first according to the history. With --failed-first,
+  the scripts that failed last time come first.
+*/
+static int order_scripts(char **scripts, int nscripts)
+{
+	struct script_order *order;
+	int n;
+
+	order = malloc(nscripts * sizeof(*order));
+	if (!order)
+		return -1;
+	for (n = 0; n < nscripts; n++) {
+		char *key = history_key(scripts[n]);
+		struct stat st;
+		int status;
+
+		order[n].script = scripts[n];
+		order[n].index = n;
+		if (history_lookup(key, 0, &order[n].duration,
+				   &status) != 0) {
+			order[n].duration = -1;
+			status = 0;
+		}
+		free(key);
+		order[n].failed = status != 0;
+		order[n].size = stat(scripts[n], &st) == 0 ? st.st_size : 0;
+	}
+	if (opt_order == ORDER_RANDOM) {
+		srand(opt_order_seed);
+		for (n = nscripts - 1; n > 0; n--) {
+			struct script_order tmp;
+			int k = rand() % (n + 1);
+
+			tmp = order[n];
+			order[n] = order[k];
+			order[k] = tmp;
+		}
+		for (n = 0; n < nscripts; n++)
+			order[n].index = n;
+	}
+	qsort(order, nscripts, sizeof(*order), compare_scripts);
+	for (n = 0; n < nscripts; n++)
+		scripts[n] = order[n].script;
+	free(order);
+	return 0;
+}
+
+/*
+  The history lives in $XDG_CACHE_HOME/shrun/history by default.
+*/
+static char *default_history(void)
+{
+	const char *cache = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+	char *file;
+
+	if (cache && *cache) {
+		file = malloc(strlen(cache) + 15);
+		if (!file)
+			return NULL;
+		sprintf(file, "%s/shrun", cache);
+	} else if (home && *home) {
+		file = malloc(strlen(home) + 22);
+		if (!file)
+			return NULL;
+		sprintf(file, "%s/.cache", home);
+		mkdir(file, 0700);
+		strcat(file, "/shrun");
+	} else
+		return NULL;
+	mkdir(file, 0777);
+	strcat(file, "/history");
+	return file;
+}
+
+/*
+  Pick the options to pass on to workers out of the noptions options in
+  argv + 1: all but --coordinator, and the options for ordering the
+  scripts and keeping their history, which only concern the coordinator.
+  Returns the number of options picked.
+*/
+static int worker_options(char *argv[], int noptions, char **options)
+{
+	int c, n = 0, next = 1;
+
+	optind = 0;
+	while ((c = getopt_long(noptions + 1, argv, "t:uUh",
+				long_options, NULL)) != -1) {
+		int skip = c == CHAR_MAX + 8 || c == CHAR_MAX + 11 ||
+			   c == CHAR_MAX + 12 || c == CHAR_MAX + 13;
+
+		/* optind only moves on at the end of a group like -uU. */
+		for (; next < optind; next++) {
+			if (!skip)
+				options[n++] = argv[next];
 		}
 	}
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	const char **shells;
+	char *copy;
+	int retval = 0, nshells, n;
+
+	progname = basename(argv[0]);
+	parse_options(argc, argv);
+
+	if (opt_worker)
+		return worker(opt_worker, run_remote_script);
+
+	if (opt_color == 0 || (opt_color == -1 && !isatty(1)))
+		ansi_red = ansi_green = ansi_clear = "";
+
+	if ((opt_record || opt_apply) &&
+	    ((opt_record && opt_apply) || opt_coordinator || opt_ab ||
+	     opt_repeat || opt_duration || strchr(opt_shell, ',') ||
+	     opt_stop_at != (unsigned int)-1)) {
+		fprintf(stderr, "%s: --record and --apply do not work "
+			"together, or with --coordinator, --ab, --repeat, "
+			"--duration, several shells, or --stop-at\n",
+			progname);
+		return 1;
+	}
+
+	if (opt_metrics &&
+	    (opt_coordinator || opt_ab || opt_repeat || opt_duration ||
+	     strchr(opt_shell, ','))) {
+		fprintf(stderr, "%s: --metrics does not work with "
+			"--coordinator, --ab, --repeat, --duration, or several "
+			"shells\n", progname);
+		return 1;
+	}
+
+	if (opt_coordinator && (opt_trace || opt_stats != -1)) {
+		fprintf(stderr, "%s: --trace and --stats do not work with "
+			"--coordinator\n", progname);
+		return 1;
+	}
+
+	if (opt_coordinator && optind == argc) {
+		fprintf(stderr, "%s: --coordinator requires script "
+			"filenames\n", progname);
+		return 1;
+	}
 
-	if (optind + 1 < argc)
-		usage(1);
 	if (optind < argc) {
-		script = argv[optind];
-		script_fd = open(script, O_RDONLY);
-		if (script_fd < 0) {
+		char *history = NULL;
+
+		if (opt_order == ORDER_DEFAULT)
+			opt_order = opt_coordinator ? ORDER_HISTORY :
+						      ORDER_GIVEN;
+		/* Only keep a history by default when it is used. */
+		if (!opt_history &&
+		    (opt_order == ORDER_HISTORY || opt_failed_first))
+			history = default_history();
+		if (opt_history && *opt_history &&
+		    history_open(opt_history) != 0) {
 			fprintf(stderr, "%s: %s: %s\n",
-			        progname, argv[optind], strerror(errno));
+				progname, opt_history, strerror(errno));
+			return 1;
+		}
+		if (history)
+			history_open(history);
+		free(history);
+
+		if (order_scripts(argv + optind, argc - optind) != 0) {
+			perror(progname);
 			return 1;
 		}
 	}
-	if (update_one || update_all) {
-		int ufd;
 
-		if (!script) {
-			fprintf(stderr, "%s: update requires a script "
-				"filename\n", progname);
+	if (opt_coordinator) {
+		char **options = malloc(optind * sizeof(*options));
+		int first = optind, noptions;
+
+		if (!options) {
+			perror(progname);
 			return 1;
 		}
-		tmpfile = malloc(strlen(script) + 8);
-		if (!tmpfile)
-			goto fail_unlink;
-		sprintf(tmpfile, "%s.XXXXXX", script);
-		ufd = mkstemp(tmpfile);
-		if (ufd == -1) {
+		noptions = worker_options(argv, first - 1, options);
+		retval = coordinator(opt_coordinator, argv + first,
+				     argc - first, options, noptions,
+				     *ansi_clear != 0, replace_script);
+		free(options);
+		goto out;
+	}
+
+	nshells = split_shells(opt_shell, &copy, &shells);
+	if (nshells < 0) {
+		perror(progname);
+		return 1;
+	}
+	for (n = 0; n < nshells; n++) {
+		if (access(shells[n], X_OK) != 0) {
+			/* FIXME: report exec failures properly instead! */
 			fprintf(stderr, "%s: %s: %s\n",
-			        progname, tmpfile, strerror(errno));
-			return 2;
+				progname, shells[n], strerror(errno));
+			return 1;
 		}
-		ufp = fdopen(ufd, "w");
-		if (!ufp)
-			goto fail_unlink;
 	}
-	if (script_fd == STDIN_FILENO)
-		opt_stop_at = (unsigned int)-1;
-	if (opt_color == 0 || (opt_color == -1 && !isatty(1)))
-		ansi_red = ansi_green = ansi_clear = "";
+	free(shells);
+	free(copy);
 
-	if (access(opt_shell, X_OK) != 0) {
-		/* FIXME: report exec failures properly instead! */
+	if (opt_trace && trace_open(opt_trace) != 0) {
 		fprintf(stderr, "%s: %s: %s\n",
-			progname, opt_shell, strerror(errno));
+			progname, opt_trace, strerror(errno));
 		return 1;
 	}
-
-	if (pipe(output) != 0 || pipe(control) != 0) {
-		perror(progname);
+	if (opt_record && record_open(opt_record) != 0) {
+		fprintf(stderr, "%s: %s: %s\n",
+			progname, opt_record, strerror(errno));
 		return 1;
 	}
-
-	child_pid = pty_fork(&ptm);
-	if (child_pid < 0) {
+	if (opt_apply && replay_open(opt_apply) != 0) {
+		fprintf(stderr, "%s: %s: %s\n",
+			progname, opt_apply, strerror(errno));
+		return 1;
+	}
+	if (opt_metrics && metrics_open(opt_metrics) != 0) {
 		perror(progname);
 		return 1;
 	}
 
-	if (child_pid == 0) {
-		close(output[PIPE_READ]);
-		if (output[PIPE_WRITE] != STDOUT_FILENO) {
-			dup2(output[PIPE_WRITE], STDOUT_FILENO);
-			close(output[PIPE_WRITE]);
-		}
-		close(control[PIPE_READ]);
-		if (control[PIPE_WRITE] != 109) {
-			dup2(control[PIPE_WRITE], 109);
-			close(control[PIPE_WRITE]);
-		}
-		if (opt_stderr)
-			dup2(STDOUT_FILENO, STDERR_FILENO);
+	if (optind == argc) {
+		double start = now();
 
-		execl(opt_shell, opt_shell, NULL);
-		fprintf(stderr, "%s%s: %s: %s%s\n",
-			ansi_red, progname, opt_shell, strerror(errno),
-			ansi_clear);
-		return 1;
-	} else {
-		close(output[PIPE_WRITE]);
-		close(control[PIPE_WRITE]);
-
-		retval = shrun(script_fd, output[PIPE_READ], ptm,
-			       control[PIPE_READ]);
-		if (retval >= 0) {
-			if ((update_one || update_all) && retval != 0) {
-				struct stat st;
-				char *backup;
-
-				if (ferror(ufp)) {
-					errno = EIO;
-					goto fail_unlink;
-				}
-				if (fclose(ufp))
-					goto fail_unlink;
-				if (update_one && retval > 1) {
-					fprintf(stderr, "%snot updating %s "
-						"(too many changes)%s\n",
-						ansi_red, script, ansi_clear);
-					retval = 2;
-					goto out;
-				}
-				backup = malloc(strlen(script) + 2);
-				if (!backup)
-					goto fail_unlink;
-				sprintf(backup, "%s~", script);
-				if (stat(script, &st) ||
-				    chmod(tmpfile, st.st_mode) ||
-				    rename(script, backup) ||
-				    rename(tmpfile, script))
-					goto fail_unlink;
-				printf("%s%s updated%s\n",
-				       ansi_green, script, ansi_clear);
-				tmpfile = NULL;
-			}
-			if (retval != 0)
-				retval = 1;
+		retval = run_script(NULL, NULL, NULL);
+		metrics_script("-", now() - start, retval);
+	}
+	for (n = optind; n < argc; n++) {
+		char *key = history_key(argv[n]);
+		double start = now();
+		int retval2;
+
+		if (argc - optind > 1) {
+			printf("[%s]\n", argv[n]);
+			fflush(stdout);
 		}
+		retval2 = run_script(argv[n], argv[n], key);
+		if (!interrupted && !opt_apply)
+			history_record(key, 0, now() - start, retval2);
+		free(key);
+		metrics_script(argv[n], now() - start, retval2);
+		retval = max(retval, retval2);
+		if (interrupted)
+			break;
+	}
+
+	if (trace_close(now()) != 0) {
+		fprintf(stderr, "%s: %s: %s\n",
+			progname, opt_trace, strerror(errno));
+		retval = 2;
+	}
+	if (record_close() != 0) {
+		fprintf(stderr, "%s: %s: %s\n",
+			progname, opt_record, strerror(errno));
+		retval = 2;
+	}
+	replay_close();
+	if (metrics_close() != 0) {
+		fprintf(stderr, "%s: %s: %s\n",
+			progname, opt_metrics, strerror(errno));
+		retval = 2;
 	}
 
 out:
-	if (tmpfile)
-		unlink(tmpfile);
+	if (history_close() != 0)
+		fprintf(stderr, "%s: not saving the history: %s\n",
+			progname, strerror(errno));
+	if (opt_stats != -1)
+		shrun_stats_write(stderr, opt_stats);
 	return retval;
-
-fail_unlink:
-	fprintf(stderr, "%s: %s\n", progname, strerror(errno));
-	retval = 2;
-	goto out;
-
 }
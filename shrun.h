@@ -0,0 +1,283 @@
+/*
+  File: shrun.h
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef __SHRUN_H
+#define __SHRUN_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <poll.h>
+
+/*
+  The library is built with -fvisibility=hidden; only what is declared
+  here is exported.
+*/
+#pragma GCC visibility push(default)
+
+/*
+  The shrun engine. A session runs one script in one shell. Sessions do
+  not block: shrun_session_pollfds() tells which file descriptors the
+  session is waiting for and for how long, and shrun_session_step() does
+  whatever work the results of poll() allow. Any number of sessions can
+  be driven from the same event loop this way. Results are passed to
+  callbacks as they become available.
+
+  Idle sessions are cheap: on x86-64 with glibc, a new session takes about
+  2 KB of heap memory, and about 5.5 KB once it waits for a command to
+  finish. Its buffers start out small, and give back what they grew to
+  for a large command once the command is done. Each buffer keeps at most
+  memory_limit bytes in memory, and spills the rest into a temporary
+  file. On top of that, each session has a shell process, a pseudo
+  terminal, and four to seven file descriptors; thousands of sessions
+  usually require a higher RLIMIT_NOFILE.
+
+  The shell is a child process, which the session reaps itself. When the
+  shell dies, a new one is started for the next command. The caller must
+  not ignore SIGCHLD, or the exit status of the shell is lost.
+*/
+
+struct shrun_session;
+struct shrun_command;
+
+enum shrun_stdin {
+	SHRUN_STDIN_AUTO,		/* fifo when the pty would get in the way */
+	SHRUN_STDIN_PTY,		/* through the terminal */
+	SHRUN_STDIN_FIFO,		/* through a pipe */
+};
+
+enum shrun_channel {
+	SHRUN_CHANNEL_PTY,		/* type commands into the terminal */
+	SHRUN_CHANNEL_FILE,		/* pass commands in a file */
+};
+
+enum shrun_input_wait {
+	SHRUN_INPUT_WAIT_FAIL,		/* end the session right away */
+	SHRUN_INPUT_WAIT_EOF,		/* send end-of-file once, then fail */
+	SHRUN_INPUT_WAIT_TIMEOUT,	/* wait for the timeout */
+};
+
+struct shrun_options {
+	const char *shell;
+	unsigned int timeout;		/* seconds; 0 = no timeout */
+	unsigned int stop_at;		/* line to go interactive at */
+	int no_stderr;
+	int isolate;
+	enum shrun_stdin stdin_mode;	/* how to pass "<" lines to commands */
+	enum shrun_channel channel;	/* how to pass commands to the shell */
+	enum shrun_input_wait input_wait;  /* when a command reads the pty */
+	const char *const *env;		/* NAME=value, added to the environment */
+	unsigned int bench;		/* run each command this many times */
+	int pace;			/* pause after each run (see resume) */
+	const char *counters;		/* perf events, comma separated */
+	size_t memory_limit;		/* 0 = no limit */
+	size_t output_limit;		/* 0 = no limit */
+	FILE *update;			/* write the updated script here */
+	/*
+	  Take the results of commands from a recording instead of running
+	  them: fill in output, status, exit_status, and duration. Returns 1
+	  when filled in, 0 when the recording ends before the command, and
+	  -1 on errors. No shell is started.
+	*/
+	int (*replay)(void *priv, struct shrun_command *command);
+	void *replay_priv;
+};
+
+enum shrun_status {
+	SHRUN_OK,
+	SHRUN_FAILED,
+	SHRUN_SHORT_RESULT,		/* no end marker, shell killed */
+	SHRUN_TIMEOUT,			/* killed after the timeout */
+	SHRUN_WAITING,			/* killed while waiting for input */
+	SHRUN_EXITED,			/* the shell died (see exit_status) */
+	SHRUN_OUTPUT_LIMIT,		/* killed for too much output */
+};
+
+enum shrun_end {
+	SHRUN_DONE,
+	SHRUN_TIMED_OUT,		/* and the shell did not recover */
+	SHRUN_INPUT_WAIT,		/* likewise */
+	SHRUN_OUTPUT_EXCEEDED,
+	SHRUN_INTERRUPTED,
+	SHRUN_UNKNOWN_CONTROL,
+	SHRUN_ERROR,
+};
+
+enum {
+	SHRUN_MIN, SHRUN_MEDIAN, SHRUN_P95, SHRUN_MAX, SHRUN_MEAN,
+	SHRUN_STDDEV, SHRUN_STATS
+};
+
+extern const char *shrun_stat_names[SHRUN_STATS + 1];
+
+#define SHRUN_COUNTERS_MAX 8
+#define SHRUN_NOT_COUNTED ((unsigned long long)-1)
+
+struct shrun_counters {
+	unsigned int n;
+	const char *name[SHRUN_COUNTERS_MAX];
+	unsigned long long value[SHRUN_COUNTERS_MAX];  /* clocks in ns */
+};
+
+struct shrun_bench {
+	unsigned int runs;
+	double stat[SHRUN_STATS];	/* seconds */
+	const char *budget;		/* as given, or NULL */
+	int budget_stat;
+	int budget_exceeded;
+};
+
+/*
+  Where the lines of a buffer are: line i goes from start[i] up to
+  start[i + 1], including its newline (the last line may not have one).
+*/
+struct shrun_lines {
+	size_t *start;			/* n + 1 entries */
+	size_t n, size;			/* size: entries allocated */
+};
+
+struct shrun_command {
+	unsigned int lineno;
+	const char *command;		/* all lines, newline terminated */
+	size_t command_len;
+	const char *output, *expected;
+	size_t output_len, expected_len;
+	/* line indexes of failed commands (of the output also when updating) */
+	const struct shrun_lines *output_lines, *expected_lines;
+	enum shrun_status status;
+	int passed;			/* output and budget ok */
+	double duration;		/* seconds, including all bench runs */
+	const struct shrun_bench *bench;  /* NULL unless benchmarked */
+	const struct shrun_counters *counters;  /* NULL unless counting */
+	int exit_status;		/* of the shell for SHRUN_EXITED, or -1 */
+};
+
+struct shrun_summary {
+	unsigned int passed, failed;
+	enum shrun_end end;
+	int error;			/* errno for SHRUN_ERROR */
+};
+
+struct shrun_callbacks {
+	/* A command is about to run (output and status are not set yet). */
+	void (*begin)(void *priv, const struct shrun_command *command);
+	/* A command has completed. */
+	void (*result)(void *priv, const struct shrun_command *command);
+	/* One run of a command has completed (see bench and pace). */
+	void (*run)(void *priv, double duration);
+	/* The session is going interactive (see stop_at). */
+	void (*interactive)(void *priv);
+	/* The session has ended. */
+	void (*end)(void *priv, const struct shrun_summary *summary);
+};
+
+#define SHRUN_POLLFDS 5
+
+extern void shrun_options_init(struct shrun_options *options);
+
+extern struct shrun_session *shrun_session_new(const struct shrun_options *options,
+					       int script_fd,
+					       const struct shrun_callbacks *callbacks,
+					       void *priv);
+extern int shrun_session_start(struct shrun_session *session);
+extern int shrun_session_pollfds(struct shrun_session *session,
+				 struct pollfd *fds, int *timeout);
+extern int shrun_session_step(struct shrun_session *session,
+			      const struct pollfd *fds, int nfds);
+extern void shrun_session_resume(struct shrun_session *session);
+extern void shrun_session_interrupt(struct shrun_session *session);
+/* The process ID of the shell, or -1 while there is none. */
+extern pid_t shrun_session_shell(struct shrun_session *session);
+extern int shrun_session_result(struct shrun_session *session);
+extern void shrun_session_free(struct shrun_session *session);
+
+/*
+  Check a list of events for the counters option. Returns -1 if an event
+  is unknown, or if there are more than SHRUN_COUNTERS_MAX.
+*/
+extern int shrun_counters_check(const char *list);
+
+extern int shrun_lines_index(struct shrun_lines *lines, const char *buf,
+			     size_t sz);
+extern void shrun_lines_free(struct shrun_lines *lines);
+
+enum shrun_stats_format {
+	SHRUN_STATS_TEXT,
+	SHRUN_STATS_JSON,		/* as one object */
+	SHRUN_STATS_OPENMETRICS,	/* metric families, without # EOF */
+};
+
+/*
+  Write out counters for the work the library itself has done, summed
+  over all sessions so far. The counters are process-wide and are not
+  updated atomically: they are only meaningful when all sessions are
+  driven from the same thread.
+*/
+extern void shrun_stats_write(FILE *fp, enum shrun_stats_format format);
+
+/* The report format of the shrun command. */
+struct shrun_text_report {
+	FILE *fp;
+	const char *red, *green, *clear;
+};
+
+extern const struct shrun_callbacks shrun_text_callbacks;
+extern void shrun_text_report_init(struct shrun_text_report *report,
+				   FILE *fp, int color);
+/* Show two buffers side by side, marking the lines that differ. */
+extern void shrun_text_report_diff(struct shrun_text_report *report,
+				   const char *buf1,
+				   const struct shrun_lines *lines1,
+				   const char *buf2,
+				   const struct shrun_lines *lines2);
+/* Likewise, for buffers not split into lines yet. */
+extern int shrun_text_report_diff_buffers(struct shrun_text_report *report,
+					  const char *buf1, size_t sz1,
+					  const char *buf2, size_t sz2);
+/* Start the line of a command: "[lineno] $ command -- ". */
+extern void shrun_text_report_command(struct shrun_text_report *report,
+				      unsigned int lineno,
+				      const char *command, size_t len);
+/* A short name for a command status, like "timed out". */
+extern const char *shrun_status_name(enum shrun_status status);
+
+/*
+  The commands and expected outputs of a script, for reports which wait
+  for the results of several sessions.
+*/
+struct shrun_row {
+	char *command, *expected;	/* null terminated */
+	size_t command_len, expected_len;
+};
+
+struct shrun_rows {
+	struct shrun_row *row;
+	size_t n, size;
+};
+
+extern char *shrun_copy(const char *buf, size_t sz);
+extern int shrun_rows_add(struct shrun_rows *rows,
+			  const struct shrun_command *command);
+/* Free the buffers of row n once it has been reported. */
+extern void shrun_rows_clear(struct shrun_rows *rows, size_t n);
+extern void shrun_rows_free(struct shrun_rows *rows);
+
+#pragma GCC visibility pop
+
+#endif  /* __SHRUN_H */
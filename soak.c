@@ -0,0 +1,506 @@
+/*
+  File: soak.c
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "soak.h"
+#include "statistics.h"
+#include "tty_wait.h"
+
+/*
+  For each command and iteration, we keep how long the command took, and
+  how much memory and how many file descriptors the shell and its
+  children had left afterwards.
+
+  In a fresh shell each time, the values of the iterations are compared
+  directly. In a single shell, a leak in one command shows in all the
+  commands after it; there, what each command added over what the shell
+  had before it is summed up over the iterations instead.
+
+  A command gets slower or leaks when a straight line through these
+  values rises significantly, and by at least SOAK_GROWTH percent of what
+  the first iterations took or had. Any file descriptor more is enough.
+*/
+#define SOAK_GROWTH 10
+
+enum { SOAK_TIME, SOAK_RSS, SOAK_FDS, SOAK_METRICS };
+
+struct sample {
+	unsigned int iteration;
+	double value[SOAK_METRICS];	/* NAN when unknown */
+	double added[SOAK_METRICS];	/* summed up in a single shell */
+};
+
+struct row {
+	unsigned int lineno;
+	char *command;
+	size_t command_len;
+	unsigned int passed, failed;
+	struct sample *samples;
+	size_t n, size;
+	double added[SOAK_METRICS];
+};
+
+struct soak {
+	struct shrun_text_report text;
+	unsigned int repeat;
+	double duration, start;
+	unsigned int iterations;	/* started so far */
+	unsigned int ran;		/* iterations with results */
+	struct shrun_session *session;
+	int fd;				/* with a single shell */
+	char *script;
+	size_t script_size;
+	unsigned int script_lines, copies;
+	struct row *rows;
+	size_t nrows, size, last;
+	double before[SOAK_METRICS];	/* before the current command */
+	struct shrun_summary summary;
+	int stopped, error;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct soak *soak_new(unsigned int repeat, double duration, FILE *fp,
+		      int color)
+{
+	struct soak *soak;
+
+	soak = calloc(1, sizeof(*soak));
+	if (!soak)
+		return NULL;
+	shrun_text_report_init(&soak->text, fp, color);
+	soak->repeat = repeat;
+	soak->duration = duration;
+	soak->start = now();
+	soak->fd = -1;
+	return soak;
+}
+
+/*
+  Start another iteration unless there have been enough, or a session
+  did not run to the end. Returns 1 to go on.
+*/
+int soak_next(struct soak *soak)
+{
+	if (soak->stopped ||
+	    (soak->repeat && soak->iterations >= soak->repeat) ||
+	    (soak->duration && soak->iterations &&
+	     now() - soak->start >= soak->duration))
+		return 0;
+	soak->iterations++;
+	return 1;
+}
+
+static int append_copy(struct soak *soak)
+{
+	off_t pos = (off_t)soak->copies * soak->script_size;
+
+	if (pwrite(soak->fd, soak->script, soak->script_size, pos) !=
+	    soak->script_size)
+		return -1;
+	soak->copies++;
+	return 0;
+}
+
+/*
+  For running all iterations in a single shell: reads the script from fd,
+  and returns a file with the first two iterations of the script in it.
+  The session needs to see where the last command of an iteration ends,
+  so the file stays one copy of the script ahead: each time an iteration
+  starts, another copy is appended, until soak_next() says enough. The
+  line numbers of later copies map back to the script.
+*/
+int soak_script(struct soak *soak, int fd)
+{
+	size_t size = 0;
+	ssize_t sz;
+	char *buf;
+
+	for (;;) {
+		buf = realloc(soak->script, size + 4097);
+		if (!buf)
+			return -1;
+		soak->script = buf;
+		sz = read(fd, buf + size, 4096);
+		if (sz < 0)
+			return -1;
+		if (sz == 0)
+			break;
+		size += sz;
+	}
+	if (size && soak->script[size - 1] != '\n')
+		soak->script[size++] = '\n';
+	soak->script_size = size;
+	for (buf = soak->script; buf < soak->script + size; buf++) {
+		if (*buf == '\n')
+			soak->script_lines++;
+	}
+
+	soak->fd = memfd_create("shrun-soak", MFD_CLOEXEC);
+	if (soak->fd < 0 || !soak_next(soak) || append_copy(soak) != 0 ||
+	    (soak_next(soak) && append_copy(soak) != 0))
+		return -1;
+	return soak->fd;
+}
+
+void soak_session(struct soak *soak, struct shrun_session *session)
+{
+	soak->session = session;
+}
+
+static struct row *find_row(struct soak *soak, unsigned int lineno,
+			    const struct shrun_command *command)
+{
+	struct row *row;
+	size_t n;
+
+	/* The commands usually come in the same order each time. */
+	for (n = 0; n < soak->nrows; n++) {
+		row = &soak->rows[(soak->last + n) % soak->nrows];
+		if (row->lineno == lineno) {
+			soak->last = (row - soak->rows + 1) % soak->nrows;
+			return row;
+		}
+	}
+	if (soak->nrows == soak->size) {
+		size_t size = soak->size ? soak->size * 2 : 16;
+
+		row = realloc(soak->rows, size * sizeof(*row));
+		if (!row)
+			return NULL;
+		soak->rows = row;
+		soak->size = size;
+	}
+	row = &soak->rows[soak->nrows];
+	memset(row, 0, sizeof(*row));
+	row->lineno = lineno;
+	row->command = shrun_copy(command->command, command->command_len);
+	if (!row->command)
+		return NULL;
+	row->command_len = command->command_len;
+	soak->nrows++;
+	soak->last = 0;
+	return row;
+}
+
+static void measure(struct soak *soak, double *value)
+{
+	unsigned long rss = 0;
+	unsigned int fds = 0;
+	pid_t shell;
+
+	value[SOAK_RSS] = value[SOAK_FDS] = NAN;
+	shell = shrun_session_shell(soak->session);
+	if (shell > 0 && process_tree_usage(shell, &rss, &fds) == 0) {
+		value[SOAK_RSS] = rss;
+		value[SOAK_FDS] = fds;
+	}
+}
+
+static void soak_cb_begin(void *priv, const struct shrun_command *command)
+{
+	struct soak *soak = priv;
+
+	measure(soak, soak->before);
+}
+
+static void soak_cb_result(void *priv, const struct shrun_command *command)
+{
+	struct soak *soak = priv;
+	unsigned int iteration = soak->iterations - 1,
+		     lineno = command->lineno;
+	struct sample *sample;
+	struct row *row;
+	int metric;
+
+	if (soak->fd != -1 && soak->script_lines) {
+		iteration = (lineno - 1) / soak->script_lines;
+		lineno = (lineno - 1) % soak->script_lines + 1;
+		if (iteration + 2 == soak->copies && soak_next(soak) &&
+		    append_copy(soak) != 0)
+			soak->error = 1;
+	}
+	row = find_row(soak, lineno, command);
+	if (!row)
+		goto fail;
+	if (row->n == row->size) {
+		size_t size = row->size ? row->size * 2 : 16;
+
+		sample = realloc(row->samples, size * sizeof(*sample));
+		if (!sample)
+			goto fail;
+		row->samples = sample;
+		row->size = size;
+	}
+	sample = &row->samples[row->n++];
+	sample->iteration = iteration;
+	if (iteration + 1 > soak->ran)
+		soak->ran = iteration + 1;
+	if (command->status == SHRUN_OK || command->status == SHRUN_FAILED)
+		sample->value[SOAK_TIME] = command->duration;
+	else
+		sample->value[SOAK_TIME] = NAN;
+	sample->added[SOAK_TIME] = sample->value[SOAK_TIME];
+	measure(soak, sample->value);
+	for (metric = SOAK_RSS; metric < SOAK_METRICS; metric++) {
+		sample->added[metric] = NAN;
+		if (isnan(sample->value[metric]) ||
+		    isnan(soak->before[metric]))
+			continue;
+		row->added[metric] += sample->value[metric] -
+				      soak->before[metric];
+		sample->added[metric] = row->added[metric];
+	}
+	if (command->passed)
+		row->passed++;
+	else
+		row->failed++;
+	return;
+
+fail:
+	soak->error = 1;
+}
+
+static void soak_cb_end(void *priv, const struct shrun_summary *summary)
+{
+	struct soak *soak = priv;
+
+	soak->summary = *summary;
+	if (summary->end != SHRUN_DONE)
+		soak->stopped = 1;
+}
+
+const struct shrun_callbacks soak_callbacks = {
+	.begin = soak_cb_begin,
+	.result = soak_cb_result,
+	.end = soak_cb_end,
+};
+
+/*
+  The mean of the known values in the first and in the last third of the
+  iterations. Returns the number of known values.
+*/
+static size_t ends(struct row *row, int metric, double *first, double *last)
+{
+	size_t n, k = 0, third, i = 0, nfirst = 0, nlast = 0;
+	double sfirst = 0, slast = 0;
+
+	for (n = 0; n < row->n; n++) {
+		if (!isnan(row->samples[n].value[metric]))
+			k++;
+	}
+	third = (k + 2) / 3;
+	for (n = 0; n < row->n; n++) {
+		double y = row->samples[n].value[metric];
+
+		if (isnan(y))
+			continue;
+		if (i < third) {
+			sfirst += y;
+			nfirst++;
+		}
+		if (i >= k - third) {
+			slast += y;
+			nlast++;
+		}
+		i++;
+	}
+	*first = sfirst / nfirst;
+	*last = slast / nlast;
+	return k;
+}
+
+/*
+  Whether a straight line through the values rises significantly over the
+  iterations. Returns the rise from the first iteration to the last, or 0.
+*/
+static double rise(struct row *row, double (*value)(struct sample *, int),
+		   int metric)
+{
+	double sx = 0, sy = 0, sxx = 0, sxy = 0, sse = 0, mx, my, b, se;
+	double x0 = -1, x1 = 0;
+	size_t n, k = 0;
+
+	for (n = 0; n < row->n; n++) {
+		double x = row->samples[n].iteration,
+		       y = value(&row->samples[n], metric);
+
+		if (isnan(y))
+			continue;
+		if (x0 < 0)
+			x0 = x;
+		x1 = x;
+		sx += x;
+		sy += y;
+		k++;
+	}
+	if (k < 3)
+		return 0;
+	mx = sx / k;
+	my = sy / k;
+	for (n = 0; n < row->n; n++) {
+		double x = row->samples[n].iteration,
+		       y = value(&row->samples[n], metric);
+
+		if (isnan(y))
+			continue;
+		sxx += (x - mx) * (x - mx);
+		sxy += (x - mx) * (y - my);
+	}
+	if (sxx == 0)
+		return 0;
+	b = sxy / sxx;
+	for (n = 0; n < row->n; n++) {
+		double x = row->samples[n].iteration,
+		       y = value(&row->samples[n], metric);
+		double e = y - my - b * (x - mx);
+
+		if (isnan(y))
+			continue;
+		sse += e * e;
+	}
+	se = sqrt(sse / (k - 2) / sxx);
+	if (b - t95(k - 2) * se <= 0)
+		return 0;
+	return b * (x1 - x0);
+}
+
+static double value(struct sample *sample, int metric)
+{
+	return sample->value[metric];
+}
+
+static double added(struct sample *sample, int metric)
+{
+	return sample->added[metric];
+}
+
+static void report_row(struct soak *soak, struct row *row, unsigned int *growing)
+{
+	static const char *const names[SOAK_METRICS] = {
+		"time", "rss", "fds"
+	};
+	static const char *const grows[SOAK_METRICS] = {
+		"slower", "memory grows", "fds grow"
+	};
+	struct shrun_text_report *text = &soak->text;
+	int metric, grew = 0;
+
+	shrun_text_report_command(text, row->lineno, row->command,
+				  row->command_len);
+	if (row->passed)
+		fprintf(text->fp, "%s%u ok%s", text->green, row->passed,
+			text->clear);
+	if (row->failed)
+		fprintf(text->fp, "%s%s%u failed%s", row->passed ? ", " : "",
+			text->red, row->failed, text->clear);
+	for (metric = 0; metric < SOAK_METRICS; metric++) {
+		double scale = metric == SOAK_TIME ? 1e3 : 1, first, last, up;
+		const char *unit = metric == SOAK_TIME ? "ms" :
+				   metric == SOAK_RSS ? "kB" : "";
+		int digits = metric == SOAK_TIME ? 3 : 0;
+
+		if (!ends(row, metric, &first, &last))
+			continue;
+		up = rise(row, soak->fd != -1 ? added : value, metric);
+		if (metric == SOAK_FDS ? up >= 1 :
+		    up > 0 && up >= first * SOAK_GROWTH / 100) {
+			fprintf(text->fp, ", %s%s %.*f->%.*f%s, %s%s",
+				text->red, names[metric],
+				digits, first * scale, digits, last * scale,
+				unit, grows[metric], text->clear);
+			grew = 1;
+		} else if (round(first * scale * 1e3) ==
+			   round(last * scale * 1e3))
+			fprintf(text->fp, ", %s %.*f%s", names[metric],
+				digits, first * scale, unit);
+		else
+			fprintf(text->fp, ", %s %.*f->%.*f%s", names[metric],
+				digits, first * scale, digits, last * scale,
+				unit);
+	}
+	fprintf(text->fp, "\n");
+	if (grew)
+		(*growing)++;
+}
+
+/*
+  Report the commands, and a summary. Returns 0 if all commands always
+  passed and nothing grew, 1 if some failed or grew, and 2 if a session
+  did not run to the end.
+*/
+int soak_result(struct soak *soak)
+{
+	struct shrun_text_report *text = &soak->text;
+	unsigned int growing = 0, failed = 0;
+	size_t n;
+	int retval = 0;
+
+	for (n = 0; n < soak->nrows; n++) {
+		report_row(soak, &soak->rows[n], &growing);
+		if (soak->rows[n].failed)
+			failed++;
+	}
+	if (soak->summary.end != SHRUN_DONE)
+		shrun_text_callbacks.end(text, &soak->summary);
+	fprintf(text->fp, "%s%u iteration%s in %.1fs, %zu commands "
+		"(%zu passed, %u failed, %u growing)%s\n",
+		failed || growing ? text->red : text->green,
+		soak->ran, soak->ran == 1 ? "" : "s",
+		now() - soak->start, soak->nrows, soak->nrows - failed,
+		failed, growing, text->clear);
+	fflush(text->fp);
+	if (failed || growing)
+		retval = 1;
+	if (soak->error || soak->summary.end != SHRUN_DONE)
+		retval = 2;
+	return retval;
+}
+
+void soak_free(struct soak *soak)
+{
+	size_t n;
+
+	if (!soak)
+		return;
+	for (n = 0; n < soak->nrows; n++) {
+		free(soak->rows[n].command);
+		free(soak->rows[n].samples);
+	}
+	free(soak->rows);
+	free(soak->script);
+	if (soak->fd != -1)
+		close(soak->fd);
+	free(soak);
+}
@@ -0,0 +1,43 @@
+/*
+  File: soak.h
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef __SOAK_H
+#define __SOAK_H
+
+#include "shrun.h"
+
+/*
+  Run a script over and over, either in a fresh shell each time or in a
+  single shell, and look for commands which get slower or leave more
+  memory or file descriptors behind from one iteration to the next. Only
+  a summary per command is reported.
+*/
+
+struct soak;
+
+extern struct soak *soak_new(unsigned int repeat, double duration, FILE *fp,
+			     int color);
+extern int soak_next(struct soak *soak);
+extern int soak_script(struct soak *soak, int fd);
+extern void soak_session(struct soak *soak, struct shrun_session *session);
+extern const struct shrun_callbacks soak_callbacks;
+extern int soak_result(struct soak *soak);
+extern void soak_free(struct soak *soak);
+
+#endif  /* __SOAK_H */
@@ -0,0 +1,150 @@
+/*
+  File: stats.c
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#include <stdio.h>
+
+#include "shrun.h"
+#include "stats.h"
+
+struct stats stats;
+
+static const char *fd_names[STATS_FDS] = {
+	"script", "shell", "control", "stdin"
+};
+
+static const char *queue_names[STATS_QUEUES] = {
+	"script", "control", "testcase", "expected", "input", "output",
+	"command", "bench", "setup"
+};
+
+static void write_text(FILE *fp)
+{
+	int n;
+
+	fprintf(fp, "wakeups: %lu\n", stats.wakeups);
+	for (n = 0; n < STATS_FDS; n++)
+		fprintf(fp, "%s: %lu reads (%llu bytes), "
+			"%lu writes (%llu bytes)\n", fd_names[n],
+			stats.reads[n], stats.read_bytes[n],
+			stats.writes[n], stats.write_bytes[n]);
+	fprintf(fp, "queues: %lu reallocs, %lu spills, %llu bytes moved\n",
+		stats.reallocs, stats.spills, stats.moved_bytes);
+	fprintf(fp, "peak:");
+	for (n = 0; n < STATS_QUEUES; n++)
+		fprintf(fp, " %s %zu", queue_names[n], stats.peak[n]);
+	fprintf(fp, "\n");
+	fprintf(fp, "end marker: %.6fs\n", stats.end_marker_time);
+	fprintf(fp, "report: %.6fs\n", stats.report_time);
+}
+
+static void write_json(FILE *fp)
+{
+	int n;
+
+	fprintf(fp, "{\"wakeups\": %lu, \"fds\": {", stats.wakeups);
+	for (n = 0; n < STATS_FDS; n++)
+		fprintf(fp, "%s\"%s\": {\"reads\": %lu, \"read_bytes\": %llu, "
+			"\"writes\": %lu, \"write_bytes\": %llu}",
+			n ? ", " : "", fd_names[n],
+			stats.reads[n], stats.read_bytes[n],
+			stats.writes[n], stats.write_bytes[n]);
+	fprintf(fp, "}, \"reallocs\": %lu, \"spills\": %lu, "
+		"\"moved_bytes\": %llu, \"peak\": {",
+		stats.reallocs, stats.spills, stats.moved_bytes);
+	for (n = 0; n < STATS_QUEUES; n++)
+		fprintf(fp, "%s\"%s\": %zu", n ? ", " : "", queue_names[n],
+			stats.peak[n]);
+	fprintf(fp, "}, \"end_marker_seconds\": %.6f, "
+		"\"report_seconds\": %.6f}\n",
+		stats.end_marker_time, stats.report_time);
+}
+
+/* Counters only go up; their samples end in _total. */
+static void write_family(FILE *fp, const char *name, const char *type,
+			 const char *help)
+{
+	fprintf(fp, "# TYPE shrun_%s %s\n# HELP shrun_%s %s\n",
+		name, type, name, help);
+}
+
+static void write_openmetrics(FILE *fp)
+{
+	int n;
+
+	write_family(fp, "wakeups", "counter", "How often shrun woke up.");
+	fprintf(fp, "shrun_wakeups_total %lu\n", stats.wakeups);
+	write_family(fp, "reads", "counter", "Reads by file descriptor.");
+	for (n = 0; n < STATS_FDS; n++)
+		fprintf(fp, "shrun_reads_total{fd=\"%s\"} %lu\n",
+			fd_names[n], stats.reads[n]);
+	write_family(fp, "read_bytes", "counter",
+		     "Bytes read by file descriptor.");
+	for (n = 0; n < STATS_FDS; n++)
+		fprintf(fp, "shrun_read_bytes_total{fd=\"%s\"} %llu\n",
+			fd_names[n], stats.read_bytes[n]);
+	write_family(fp, "writes", "counter", "Writes by file descriptor.");
+	for (n = 0; n < STATS_FDS; n++)
+		fprintf(fp, "shrun_writes_total{fd=\"%s\"} %lu\n",
+			fd_names[n], stats.writes[n]);
+	write_family(fp, "write_bytes", "counter",
+		     "Bytes written by file descriptor.");
+	for (n = 0; n < STATS_FDS; n++)
+		fprintf(fp, "shrun_write_bytes_total{fd=\"%s\"} %llu\n",
+			fd_names[n], stats.write_bytes[n]);
+	write_family(fp, "queue_reallocs", "counter",
+		     "How often buffers grew.");
+	fprintf(fp, "shrun_queue_reallocs_total %lu\n", stats.reallocs);
+	write_family(fp, "queue_spills", "counter",
+		     "How often buffers spilled into a file.");
+	fprintf(fp, "shrun_queue_spills_total %lu\n", stats.spills);
+	write_family(fp, "queue_moved_bytes", "counter",
+		     "Bytes moved when buffers were compacted.");
+	fprintf(fp, "shrun_queue_moved_bytes_total %llu\n", stats.moved_bytes);
+	write_family(fp, "queue_peak_bytes", "gauge",
+		     "How large each buffer got.");
+	for (n = 0; n < STATS_QUEUES; n++)
+		fprintf(fp, "shrun_queue_peak_bytes{queue=\"%s\"} %zu\n",
+			queue_names[n], stats.peak[n]);
+	write_family(fp, "end_marker_seconds", "counter",
+		     "Time spent looking for end markers.");
+	fprintf(fp, "shrun_end_marker_seconds_total %.6f\n",
+		stats.end_marker_time);
+	write_family(fp, "report_seconds", "counter",
+		     "Time spent reporting results.");
+	fprintf(fp, "shrun_report_seconds_total %.6f\n", stats.report_time);
+}
+
+void shrun_stats_write(FILE *fp, enum shrun_stats_format format)
+{
+	switch(format) {
+	case SHRUN_STATS_TEXT:
+		write_text(fp);
+		break;
+
+	case SHRUN_STATS_JSON:
+		write_json(fp);
+		break;
+
+	case SHRUN_STATS_OPENMETRICS:
+		write_openmetrics(fp);
+		break;
+	}
+	fflush(fp);
+}
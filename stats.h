@@ -0,0 +1,50 @@
+/*
+  File: stats.h
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stddef.h>
+
+/*
+  Counters for shrun's own work, for all sessions in the process. They
+  are always collected: each is an increment next to a system call that
+  is made anyway, or a read of the vDSO clock. They are not atomic, so
+  sessions driven from several threads at once mix up the numbers; the
+  symbol is hidden in libshrun.so.
+*/
+
+enum { STATS_SCRIPT, STATS_SHELL, STATS_CONTROL, STATS_STDIN, STATS_FDS };
+enum { STATS_Q_SCRIPT, STATS_Q_CONTROL, STATS_Q_TESTCASE, STATS_Q_EXPECTED,
+       STATS_Q_INPUT, STATS_Q_OUTPUT, STATS_Q_COMMAND, STATS_Q_BENCH,
+       STATS_Q_SETUP, STATS_QUEUES };
+
+struct stats {
+	unsigned long wakeups;
+	unsigned long reads[STATS_FDS], writes[STATS_FDS];
+	unsigned long long read_bytes[STATS_FDS], write_bytes[STATS_FDS];
+	unsigned long reallocs, spills;
+	unsigned long long moved_bytes;
+	size_t peak[STATS_QUEUES];
+	double end_marker_time, report_time;
+};
+
+extern struct stats stats;
+
+#endif  /* __STATS_H */
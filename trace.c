@@ -0,0 +1,184 @@
+/*
+  File: trace.c
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+/*
+  Write events in the Trace Event Format understood by chrome://tracing
+  and Perfetto. All timestamps are in seconds on the monotonic clock;
+  the format wants microseconds.
+*/
+
+struct trace_thread {
+	unsigned int depth;
+	int named;
+};
+
+static FILE *trace_fp;
+static unsigned int trace_events;
+static struct trace_thread *trace_threads;
+static int trace_nthreads;
+static const char *trace_kind[] = { NULL, "command", "span" };
+
+static int trace_kind_of(int tid)
+{
+	return (tid - 1) % 2 + 1;
+}
+
+static void trace_string(const char *str, size_t len)
+{
+	putc('"', trace_fp);
+	for (; len; str++, len--) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			fprintf(trace_fp, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(trace_fp, "\\u%04x", c);
+		else
+			putc(c, trace_fp);
+	}
+	putc('"', trace_fp);
+}
+
+static void write_event(int tid, char phase, const char *name, size_t len,
+			double ts)
+{
+	fputs(trace_events++ ? ",\n" : "\n", trace_fp);
+	fputs("{\"name\":", trace_fp);
+	trace_string(name, len);
+	fprintf(trace_fp, ",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+		"\"pid\":%d,\"tid\":%d", trace_kind[trace_kind_of(tid)],
+		phase, ts * 1e6, (int)getpid(), tid);
+}
+
+/*
+  The state of thread tid, which is named when it first shows up. Returns
+  NULL if out of memory.
+*/
+static struct trace_thread *trace_thread(int tid)
+{
+	struct trace_thread *thread;
+
+	if (tid >= trace_nthreads) {
+		int n = tid + 16;
+
+		thread = realloc(trace_threads, n * sizeof(*thread));
+		if (!thread)
+			return NULL;
+		memset(thread + trace_nthreads, 0,
+		       (n - trace_nthreads) * sizeof(*thread));
+		trace_threads = thread;
+		trace_nthreads = n;
+	}
+	thread = &trace_threads[tid];
+	if (!thread->named) {
+		write_event(tid, 'M', "thread_name", 11, 0);
+		fprintf(trace_fp, ",\"args\":{\"name\":\"%ss %d\"}}",
+			trace_kind[trace_kind_of(tid)], (tid - 1) / 2 + 1);
+		thread->named = 1;
+	}
+	return thread;
+}
+
+static struct trace_thread *trace_event(int tid, char phase,
+					const char *name, size_t len,
+					double ts)
+{
+	struct trace_thread *thread = trace_thread(tid);
+
+	if (thread)
+		write_event(tid, phase, name, len, ts);
+	return thread;
+}
+
+int trace_open(const char *filename)
+{
+	trace_fp = fopen(filename, "w");
+	if (!trace_fp)
+		return -1;
+	fputs("{\"traceEvents\":[", trace_fp);
+	return 0;
+}
+
+int trace_close(double ts)
+{
+	int tid, retval;
+
+	if (!trace_fp)
+		return 0;
+	for (tid = 0; tid < trace_nthreads; tid++) {
+		while (trace_threads[tid].depth)
+			trace_end(tid, ts);
+	}
+	fputs("\n]}\n", trace_fp);
+	retval = ferror(trace_fp) ? -1 : 0;
+	if (fclose(trace_fp))
+		retval = -1;
+	trace_fp = NULL;
+	free(trace_threads);
+	trace_threads = NULL;
+	trace_nthreads = 0;
+	return retval;
+}
+
+void trace_begin(int tid, const char *name, size_t len, unsigned int lineno,
+		 double ts)
+{
+	struct trace_thread *thread;
+
+	if (!trace_fp)
+		return;
+	thread = trace_event(tid, 'B', name, len, ts);
+	if (!thread)
+		return;
+	if (lineno)
+		fprintf(trace_fp, ",\"args\":{\"line\":%u}", lineno);
+	fputs("}", trace_fp);
+	thread->depth++;
+}
+
+void trace_end(int tid, double ts)
+{
+	if (!trace_fp || tid >= trace_nthreads || !trace_threads[tid].depth)
+		return;
+	write_event(tid, 'E', "", 0, ts);
+	fputs("}", trace_fp);
+	trace_threads[tid].depth--;
+}
+
+void trace_complete(int tid, const char *name, double start, double end)
+{
+	if (!trace_fp || !trace_event(tid, 'X', name, strlen(name), start))
+		return;
+	fprintf(trace_fp, ",\"dur\":%.3f}", (end - start) * 1e6);
+}
+
+void trace_instant(int tid, const char *name, double ts)
+{
+	if (!trace_fp || !trace_event(tid, 'i', name, strlen(name), ts))
+		return;
+	fputs(",\"s\":\"t\"}", trace_fp);
+}
@@ -0,0 +1,41 @@
+/*
+  File: trace.h
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stddef.h>
+
+/*
+  Trace "threads": each session has one for its commands, and one for
+  user-defined spans, so that the events of sessions running side by side
+  nest properly.
+*/
+enum { TRACE_COMMANDS = 1, TRACE_SPANS = 2 };
+#define TRACE_THREAD(session, kind) ((session) * 2 + (kind))
+
+extern int trace_open(const char *filename);
+extern int trace_close(double ts);
+extern void trace_begin(int tid, const char *name, size_t len,
+			unsigned int lineno, double ts);
+extern void trace_end(int tid, double ts);
+extern void trace_complete(int tid, const char *name, double start, double end);
+extern void trace_instant(int tid, const char *name, double ts);
+
+#endif  /* __TRACE_H */
@@ -0,0 +1,227 @@
+/*
+  File: tty_wait.c
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tty_wait.h"
+
+static ssize_t read_file(const char *path, char *buf, size_t size)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len >= 0)
+		buf[len] = '\0';
+	return len;
+}
+
+/* Is process pid blocked in a read from the terminal tty? */
+static int reading_tty(pid_t pid, dev_t tty)
+{
+	char path[64], buf[256];
+	struct stat st;
+	long nr;
+	int fd;
+
+	/*
+	  The syscall file has the system call a blocked process is in and
+	  its arguments; the kernel may not have it, or not let us see it.
+	*/
+	snprintf(path, sizeof(path), "/proc/%d/syscall", pid);
+	if (read_file(path, buf, sizeof(buf)) > 0 &&
+	    sscanf(buf, "%ld %i", &nr, &fd) == 2) {
+		if (nr != SYS_read && nr != SYS_readv)
+			return 0;
+		snprintf(path, sizeof(path), "/proc/%d/fd/%d", pid, fd);
+		return stat(path, &st) == 0 && S_ISCHR(st.st_mode) &&
+		       st.st_rdev == tty;
+	}
+	snprintf(path, sizeof(path), "/proc/%d/wchan", pid);
+	return read_file(path, buf, sizeof(buf)) > 0 &&
+	       strcmp(buf, "n_tty_read") == 0;
+}
+
+/* The state of process pid, or 0 if it does not exist. */
+static char proc_state(pid_t pid, pid_t *pgrp)
+{
+	char path[64], buf[512], *p, state;
+	int g;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if (read_file(path, buf, sizeof(buf)) <= 0)
+		return 0;
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 1, " %c %*d %d", &state, &g) != 2)
+		return 0;
+	if (pgrp)
+		*pgrp = g;
+	return state;
+}
+
+/*
+  A process in process group pgrp among process pid and its descendants
+  which is blocked reading from terminal tty, or 0.
+*/
+static pid_t find_reader(pid_t pid, pid_t pgrp, dev_t tty)
+{
+	char path[64], buf[4096], *p, *end;
+	pid_t g;
+
+	if (proc_state(pid, &g) == 'S' && g == pgrp && reading_tty(pid, tty))
+		return pid;
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/children", pid, pid);
+	if (read_file(path, buf, sizeof(buf)) <= 0)
+		return 0;
+	for (p = buf; ; p = end) {
+		pid_t child = strtol(p, &end, 10), reader;
+
+		if (end == p)
+			break;
+		reader = find_reader(child, pgrp, tty);
+		if (reader)
+			return reader;
+	}
+	return 0;
+}
+
+/*
+  Find a process among process pid and its descendants which is in the
+  foreground process group of the terminal open as fd (device tty), and
+  which is sleeping in a read from the terminal: this process is waiting
+  for input. Returns its pid, or 0 if there is none.
+*/
+pid_t tty_reader(int fd, dev_t tty, pid_t pid)
+{
+	pid_t pgrp;
+
+	pgrp = tcgetpgrp(fd);
+	if (pgrp <= 0 || pid <= 0)
+		return 0;
+	return find_reader(pid, pgrp, tty);
+}
+
+/*
+  Send signal sig to the descendants of process pid, the deepest first;
+  only to those in process group pgrp unless pgrp is 0. The pids of up
+  to max of them are stored in pids. Returns how many there were.
+*/
+int kill_descendants(pid_t pid, pid_t pgrp, int sig, pid_t *pids, int max)
+{
+	char path[64], buf[4096], *p, *end;
+	int n = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/children", pid, pid);
+	if (read_file(path, buf, sizeof(buf)) <= 0)
+		return 0;
+	for (p = buf; ; p = end) {
+		pid_t child = strtol(p, &end, 10), g;
+
+		if (end == p)
+			break;
+		n += kill_descendants(child, pgrp, sig,
+				      pids + (n < max ? n : max),
+				      n < max ? max - n : 0);
+		if (proc_state(child, &g) && (!pgrp || g == pgrp) &&
+		    kill(child, sig) == 0) {
+			if (n < max)
+				pids[n] = child;
+			n++;
+		}
+	}
+	return n;
+}
+
+/* Are all of the processes in pids gone (or zombies)? */
+int processes_gone(const pid_t *pids, int n)
+{
+	while (n--) {
+		char state = proc_state(pids[n], NULL);
+
+		if (state && state != 'Z' && state != 'X')
+			return 0;
+	}
+	return 1;
+}
+
+/* The first child of process pid, or 0. */
+pid_t first_child(pid_t pid)
+{
+	char path[64], buf[64];
+
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/children", pid, pid);
+	if (read_file(path, buf, sizeof(buf)) <= 0)
+		return 0;
+	return atoi(buf);
+}
+
+/*
+  Add the resident memory (in kB) and the open file descriptors of
+  process pid and all its descendants to *rss and *fds. Returns -1 if pid
+  does not exist.
+*/
+int process_tree_usage(pid_t pid, unsigned long *rss, unsigned int *fds)
+{
+	char path[64], buf[4096], *p, *end;
+	unsigned long pages;
+	struct dirent *dirent;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+	if (read_file(path, buf, sizeof(buf)) <= 0 ||
+	    sscanf(buf, "%*u %lu", &pages) != 1)
+		return -1;
+	*rss += pages * (sysconf(_SC_PAGESIZE) / 1024);
+	snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+	dir = opendir(path);
+	if (dir) {
+		while ((dirent = readdir(dir))) {
+			if (dirent->d_name[0] != '.')
+				(*fds)++;
+		}
+		closedir(dir);
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/children", pid, pid);
+	if (read_file(path, buf, sizeof(buf)) <= 0)
+		return 0;
+	for (p = buf; ; p = end) {
+		pid_t child = strtol(p, &end, 10);
+
+		if (end == p)
+			break;
+		process_tree_usage(child, rss, fds);
+	}
+	return 0;
+}
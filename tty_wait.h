@@ -0,0 +1,34 @@
+/*
+  File: tty_wait.h
+
+  Copyright (C) 2008 Andreas Gruenbacher <agruen@suse.de>, SUSE Labs
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; either
+  version 2 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this program. If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#ifndef __TTY_WAIT_H
+#define __TTY_WAIT_H
+
+#include <sys/types.h>
+
+extern pid_t tty_reader(int fd, dev_t tty, pid_t pid);
+extern int kill_descendants(pid_t pid, pid_t pgrp, int sig, pid_t *pids,
+			    int max);
+extern int processes_gone(const pid_t *pids, int n);
+extern pid_t first_child(pid_t pid);
+extern int process_tree_usage(pid_t pid, unsigned long *rss,
+			      unsigned int *fds);
+
+#endif  /* __TTY_WAIT_H */